@@ -2,8 +2,10 @@
 
 typedef unsigned char uchar_t;
 typedef unsigned char uchar;
+typedef unsigned short ushort_t;
 typedef unsigned int uint_t;
 typedef unsigned int uint;
+typedef unsigned long long ulong_t;
 
 #include <stddef.h>  // for offsetof macro
 
@@ -8,11 +8,17 @@
 #include <unistd.h>
 #include <limits.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <getopt.h>
+#include <errno.h>
+#include <sys/wait.h>
 
 #include "common.h"
 #include "list.h"
 #include "stream.h"
 #include "symbol.h"
+#include "grammar.h"
+#include "parse.h"
 
 
 // Element definition
@@ -43,6 +49,7 @@ static uint_t patt_len;
 #define ALGO_SYM_EXT  5
 #define ALGO_SYM_INT  6
 #define ALGO_REP_SE   7
+#define ALGO_AUTO     8  // smallest of all
 
 uchar opt_algo;
 uchar opt_compress;
@@ -51,28 +58,107 @@ uchar opt_sym;
 uchar opt_time;
 uchar opt_verb;
 
+uint opt_budget;  // time budget in milliseconds (0 = none)
+const char * opt_grammar;  // grammar cache file
+const char * opt_cache;    // output cache directory
+const char * opt_warm;     // grammar of a previous version
+uchar opt_dry;             // estimate the output size only
+uint opt_ties = 1;         // tie-break policies tried by the crunch
+
+
+// Compression levels
+// Trade the ratio of the grammar algorithms for speed
+
+#define LEVEL_MAX 9
+
+struct level_s
+	{
+	uint_t pair_min;     // minimum count of a crunched pair
+	uint_t batch;        // pairs crunched per round
+	uint_t width_count;  // reference widths to evaluate (0 = all)
+	};
+
+typedef struct level_s level_t;
+
+static const level_t levels [LEVEL_MAX + 1] =
+	{
+	{ 0,  0,  0 },  // unused
+	{ 8, 64,  1 },
+	{ 6, 32,  1 },
+	{ 4, 16,  2 },
+	{ 3,  8,  2 },
+	{ 3,  4,  3 },
+	{ 2,  2,  3 },
+	{ 2,  1,  4 },
+	{ 2,  1,  6 },
+	{ 2,  1,  0 },  // default: full search
+	};
+
+static uint_t width_count;
+
 static uint base_count;
 static uint def_count;
 static uint ref_count;
 static uint rep_count;
 
+static uint est_cost;  // frame cost of the best selection in bits
+
+static uchar algo_fail;  // the frame cannot be encoded by the algorithm
+
 //------------------------------------------------------------------------------
 // Algorithms
 //------------------------------------------------------------------------------
 
+// Build the grammar for the symbol algorithms
+// Loaded from the cache when valid, else crunched and saved
+// The crunch may start from the grammar of a previous version
+// A grammar cut by the time budget is not saved
+// Built once for all the estimated algorithms
+
+static uchar grammar_done;
+
+static void crunch_grammar ()
+	{
+	if (grammar_done) return;
+	grammar_done = 1;
+
+	if (opt_grammar)
+		{
+		if (grammar_load (opt_grammar, opt_warm != NULL))
+			{
+			if (opt_verb) printf ("Grammar loaded: %u symbols\n\n", sym_count);
+			return;
+			}
+
+		if (opt_verb) puts ("Grammar not loaded: missing, not valid or other settings\n");
+		}
+
+	if (opt_warm)
+		{
+		if (!grammar_warm (opt_warm))
+			error (0, 0, "warm start ignored: missing or bad grammar file");
+		else if (opt_verb)
+			printf ("Warm start: %u words covering %u bytes\n\n", warm_count, warm_size);
+		}
+
+	crunch_word ();
+
+	if (opt_grammar && !opt_budget) grammar_save (opt_grammar, opt_warm != NULL);
+	}
+
+
 // Compression with "base" (no compression)
 // Just for testing
 
 static void compress_b ()
 	{
-	list_t * node = pos_root.next;
-	while (node != &pos_root)
+	uint_t pos = pos_head;
+	while (pos != POS_NONE)
 		{
-		position_t * pos = structof (position_t, node, node);
-		symbol_t * sym = pos->sym;
+		symbol_t * sym = pos_sym [pos];
 		out_byte (sym->code);
 
-		node = node->next;
+		pos = pos_next [pos];
 		}
 	}
 
@@ -82,13 +168,26 @@ static void compress_b ()
 
 static void expand_b ()
 	{
-	for (uint_t i = 0; i < size_in; i++)
+	while (!in_eof ())
 		{
 		out_byte (in_byte ());
 		}
 	}
 
 
+// Store the frame as is when the compression does not pay off
+// Decompressed with "base"
+
+static void store_frame ()
+	{
+	size_out = 0;
+	out_byte (ALGO_BASE);
+
+	memcpy (frame_out + size_out, frame_in, size_in);
+	size_out += size_in;
+	}
+
+
 // Compression with "repeated base"
 // Just for testing
 
@@ -96,11 +195,10 @@ static void compress_rb ()
 	{
 	crunch_rep ();
 
-	list_t * node = pos_root.next;
-	while (node != &pos_root)
+	uint_t pos = pos_head;
+	while (pos != POS_NONE)
 		{
-		position_t * pos = structof (position_t, node, node);
-		symbol_t * sym = pos->sym;
+		symbol_t * sym = pos_sym [pos];
 
 		if (sym->repeat)
 			{
@@ -117,7 +215,7 @@ static void compress_rb ()
 
 		out_code (sym->code, 8);
 
-		node = node->next;
+		pos = pos_next [pos];
 		}
 
 	out_pad ();
@@ -150,11 +248,11 @@ static void expand_rb ()
 
 static void compress_pb ()
 	{
-	sym_sort (SORT_USE);
-
 	// No more than 6 prefixed bits to save space
 	// so no more than 14 indexed symbols
 
+	sym_top (SORT_USE, 14);
+
 	uint_t count = (sym_count < 14) ? sym_count : 14;
 
 	out_pref_odd (count - 1);
@@ -168,11 +266,10 @@ static void compress_pb ()
 
 	out_pref_odd (pos_count - 1);
 
-	list_t * node = pos_root.next;
-	while (node != &pos_root)
+	uint_t pos = pos_head;
+	while (pos != POS_NONE)
 		{
-		position_t * pos = structof (position_t, node, node);
-		symbol_t * sym = pos->sym;
+		symbol_t * sym = pos_sym [pos];
 
 		// Use index only when space gain
 
@@ -187,7 +284,7 @@ static void compress_pb ()
 			out_code (sym->code, 8);
 			}
 
-		node = node->next;
+		pos = pos_next [pos];
 		}
 
 	out_pad ();
@@ -199,7 +296,7 @@ static void compress_pb ()
 
 static void expand_pb ()
 	{
-	list_init (&sym_root);
+	sym_reset ();
 
 	uint_t count = 1 + in_pref_odd ();
 
@@ -237,11 +334,11 @@ static void compress_rpb ()
 	{
 	crunch_rep ();
 
-	sym_sort (SORT_REP);
-
 	// No more than 6 prefixed bits to save space
 	// so no more than 14 indexed symbols
 
+	sym_top (SORT_REP, 14);
+
 	uint count = (sym_count < 14) ? sym_count : 14;
 
 	out_pref_odd (count - 1);
@@ -255,11 +352,10 @@ static void compress_rpb ()
 
 	out_pref_odd (pos_count - 1);
 
-	list_t * node = pos_root.next;
-	while (node != &pos_root)
+	uint_t pos = pos_head;
+	while (pos != POS_NONE)
 		{
-		position_t * pos = structof (position_t, node, node);
-		symbol_t * sym = pos->sym;
+		symbol_t * sym = pos_sym [pos];
 
 		uchar_t rep = 0;
 
@@ -288,7 +384,7 @@ static void compress_rpb ()
 			out_code (sym->code, 8);
 			}
 
-		node = node->next;
+		pos = pos_next [pos];
 		}
 
 	out_pad ();
@@ -300,7 +396,7 @@ static void compress_rpb ()
 
 static void expand_rpb ()
 	{
-	list_init (&sym_root);
+	sym_reset ();
 
 	uint_t count = 1 + in_pref_odd ();
 
@@ -353,12 +449,158 @@ static void expand_rpb ()
 	}
 
 
+// Reference width candidates
+// Each width is evaluated on its own copy of the selection state
+
+#define CAND_MAX 32
+
+struct cand_s
+	{
+	table_t tab;
+
+	uint worth;  // worth symbol count
+	uint cost;   // frame cost in bits
+
+	void (* eval) (struct cand_s * cand);
+	};
+
+typedef struct cand_s cand_t;
+
+struct worker_s
+	{
+	cand_t * cands;
+	uint_t count;
+	uint_t first;  // first candidate of the worker
+	uint_t step;   // number of workers
+
+	pthread_t thread;
+	};
+
+typedef struct worker_s worker_t;
+
+static void * cand_work (void * arg)
+	{
+	worker_t * worker = (worker_t *) arg;
+
+	for (uint_t c = worker->first; c < worker->count; c += worker->step)
+		{
+		cand_t * cand = worker->cands + c;
+		cand->eval (cand);
+		}
+
+	return NULL;
+	}
+
+
+// Evaluate all the reference widths from the current one down to 1,
+// or only the width 0 when the current one is 0
+// and save the selection with the lowest cost
+// Ties are broken by the widest reference
+
+static uchar cand_best (table_t * tab, void (* eval) (cand_t * cand), uint * best_keep)
+	{
+	cand_t cands [CAND_MAX];
+	uint_t count = tab->ref_bit ? tab->ref_bit : 1;
+
+	// Only the widest ones on lower levels
+
+	if (width_count && count > width_count)
+		{
+		if (opt_verb) printf ("Skipped widths: %u\n\n", count - width_count);
+		count = width_count;
+		}
+
+	for (uint_t c = 0; c < count; c++)
+		{
+		cand_t * cand = cands + c;
+
+		table_fork (&cand->tab, tab);
+		cand->tab.ref_bit = tab->ref_bit - c;
+		cand->eval = eval;
+		}
+
+	uint_t worker_count = thread_count;
+	if (worker_count > count) worker_count = count;
+
+	worker_t workers [THREAD_MAX];
+
+	for (uint_t w = 0; w < worker_count; w++)
+		{
+		worker_t * worker = workers + w;
+
+		worker->cands = cands;
+		worker->count = count;
+		worker->first = w;
+		worker->step = worker_count;
+
+		if (w && pthread_create (&worker->thread, NULL, cand_work, worker))
+			error (1, 0, "cannot create thread");
+		}
+
+	if (worker_count) cand_work (workers);
+
+	for (uint_t w = 1; w < worker_count; w++)
+		pthread_join (workers [w].thread, NULL);
+
+	uchar best_bit = UCHAR_MAX;
+	cand_t * best = NULL;
+
+	for (uint_t c = 0; c < count; c++)
+		{
+		cand_t * cand = cands + c;
+
+		if (opt_verb)
+			{
+			printf ("Reference bits: %u\n", cand->tab.ref_bit);
+			printf ("Worth symbols: %u\n", cand->worth);
+			printf ("Kept symbols: %u\n", cand->tab.keep_count);
+			printf ("Frame cost: %u bytes\n\n", cand->cost / 8);
+			}
+
+		if (!best || cand->cost < best->cost) best = cand;
+		}
+
+	if (best)
+		{
+		best_bit = best->tab.ref_bit;
+		*best_keep = best->tab.keep_count;
+		est_cost = best->cost;
+
+		memcpy (tab->best_keep, best->tab.keep, tab->count * sizeof (uchar));
+		memcpy (tab->best_len, best->tab.len, tab->count * sizeof (uint));
+		}
+
+	// The dictionary holds at least one symbol
+	// so keep the most used base symbol when none is worth
+
+	if (!*best_keep)
+		{
+		uint_t top = tab->count;
+
+		for (uint_t i = 0; i < tab->count; i++)
+			{
+			if (tab->size [i] != 1) continue;
+			if (top == tab->count || tab->pos_count [i] > tab->pos_count [top]) top = i;
+			}
+
+		tab->best_keep [top] = 1;
+		tab->best_len [top] = 1;
+		*best_keep = 1;
+		}
+
+	for (uint_t c = 0; c < count; c++)
+		table_free (&cands [c].tab);
+
+	return best_bit;
+	}
+
+
 // Compression with "symbol"
 // Prepended dictionary (external)
 
-static uchar out_child_se (symbol_t * sym, uchar def_len, uchar def_now, uchar pos);
+static uint out_child_se (symbol_t * sym, uint def_len, uint def_now, uchar pos);
 
-static uchar out_sym_se (symbol_t * sym, uchar def_len, uchar def_now, uchar pos)
+static uint out_sym_se (symbol_t * sym, uint def_len, uint def_now, uchar pos)
 	{
 	if (sym->keep)
 		{
@@ -380,7 +622,7 @@ static uchar out_sym_se (symbol_t * sym, uchar def_len, uchar def_now, uchar pos
 	return def_now;
 	}
 
-static uchar out_child_se (symbol_t * sym, uchar def_len, uchar def_now, uchar pos)
+static uint out_child_se (symbol_t * sym, uint def_len, uint def_now, uchar pos)
 	{
 	if (sym->size == 1)
 		{
@@ -404,6 +646,115 @@ static uchar out_child_se (symbol_t * sym, uchar def_len, uchar def_now, uchar p
 	}
 
 
+// Cost of a symbol in the frame as output by out_sym_se
+
+static uint cost_sym_se (symbol_t * sym, uchar pos)
+	{
+	if (sym->keep) return pos + 1 + ref_bit;
+	if (sym->size == 1) return 9;
+
+	return cost_sym_se (sym->left, pos) + cost_sym_se (sym->right, pos);
+	}
+
+
+// Cost of the frame as crunched
+// Repeats only with the repeat symbols
+
+static uint cost_seq (uchar rep)
+	{
+	uint cost = 0;
+
+	uint_t pos = pos_head;
+	while (pos != POS_NONE)
+		{
+		symbol_t * sym = pos_sym [pos];
+		pos = pos_next [pos];
+
+		if (!sym->repeat)
+			{
+			cost += cost_sym_se (sym, rep);
+			continue;
+			}
+
+		symbol_t * child = sym->left;
+
+		if (child->size == 1 || child->keep)
+			cost += 2 + cost_pref_odd (sym->rep_count - 2) + cost_sym_se (child, 0);
+		else
+			cost += sym->rep_count * cost_sym_se (child, 1);
+		}
+
+	return cost;
+	}
+
+
+// Parse the frame again with the kept symbols
+// Returns 1 when the parse is cheaper than the crunched sequence
+
+static uchar parse_best (uchar rep)
+	{
+	parse_cost_t cost;
+
+	cost.base = 9;
+	cost.sym = rep + 1 + ref_bit;  // with the position flag of a repeat frame
+
+	cost.rep = rep ? 2 : 0;
+	cost.rep_base = 9;
+	cost.rep_sym = 1 + ref_bit;
+
+	uint seq = cost_seq (rep);
+	uint parse = parse_frame (&cost);
+
+	if (parse >= seq) return 0;
+
+	if (opt_verb) printf ("Parsed frame: %u bits less\n\n", seq - parse);
+
+	est_cost -= seq - parse;
+	return 1;
+	}
+
+
+// Output the parsed frame
+
+static void out_base (uchar_t code)
+	{
+	out_bit (0);  // base
+	out_code (code, 8);
+	base_count++;
+	}
+
+static void out_parse (uchar rep)
+	{
+	for (uint_t t = 0; t < parse_count; t++)
+		{
+		parse_tok_t * tok = parse_toks + t;
+		symbol_t * sym = tok->sym;
+
+		if (tok->rep > 1)
+			{
+			out_bit (1);  // repeat
+			out_bit (0);
+			out_pref_odd (tok->rep - 2);
+
+			if (sym)
+				out_sym_se (sym, 0, 0, 0);  // outside a definition - in repeat
+			else
+				out_base (frame_in [tok->pos]);
+
+			rep_count++;
+			}
+		else if (sym)
+			{
+			out_sym_se (sym, 0, 0, rep);  // outside a definition
+			}
+		else
+			{
+			out_base (frame_in [tok->pos]);
+			}
+		}
+	}
+
+
 // Walk the element tree
 
 #define PATTERN_MAX (32768)
@@ -438,117 +789,84 @@ static void walk_elem (uint_t i)
 	}
 
 
-static void compress_se ()
+static void eval_se (cand_t * cand)
 	{
-	crunch_word ();
-
-	if (opt_sym)
-		{
-		sym_sort (SORT_ALL);
-		sym_list (LIST_ALL);
-		}
-
-	// First consider that all the duplicated symbols are worth to keep
-	// and compute the number of bits to reference all that symbols
+	table_t * tab = &cand->tab;
 
-	keep_count = keep_dup ();
-
-	if (opt_verb) printf ("Duplicated symbols: %u\n\n", keep_count);
-	ref_bit = log2u (keep_count - 1);
-
-	uchar best_bit = UCHAR_MAX;
-	uint best_keep = UINT_MAX;
-	uint min_cost = UINT_MAX;
+	// Compute the symbol costs
 
-	// Iterate on the reference bits down to 0 to get the best one
+	tab->keep_count = 0;
 
-	list_t * node;
+	for (uint_t i = 0; i < tab->count; i++)
+		sym_cost_se (tab, i, 1);  // select
 
-	while (ref_bit > 0)
-		{
-		if (opt_verb) printf ("Reference bits: %u\n", ref_bit);
+	cand->worth = tab->keep_count;
 
-		// Compute the symbol costs
+	// Discard worthless
 
-		keep_count = 0;
+	keep_trunc (tab, 1u << tab->ref_bit);
 
-		node = sym_root.next;
-		while (node != &sym_root)
-			{
-			symbol_t * sym = structof (symbol_t, node, node);
-			sym_cost_se (sym, 1);  // select
-			node = node->next;
-			}
+	// Recompute the symbol costs
 
-		if (opt_verb) printf ("Worth symbols: %u\n", keep_count);
+	uint cost = 0;
+	for (uint_t i = 0; i < tab->count; i++)
+		cost += sym_cost_se (tab, i, 0);  // no select
 
-		// Discard worthless
+	cand->cost = cost;
+	}
 
-		sym_sort (SORT_GAIN);
 
-		uint keep_max = 1 << ref_bit;
-		if (keep_count > keep_max)
-			{
-			for (uint i = keep_max; i < keep_count; i++)
-				{
-				index_sym_t * index = index_sym + i;
-				symbol_t * sym = index->sym;
-				sym->keep = 0;
-				}
+static void compress_se ()
+	{
+	crunch_grammar ();
 
-			keep_count = keep_max;
-			}
+	if (opt_sym)
+		{
+		sym_sort (SORT_ALL);
+		sym_list (LIST_ALL);
+		}
 
-		if (opt_verb) printf ("Kept symbols: %u\n", keep_count);
+	table_t * tab = &sym_table;
+	table_build (tab);
 
-		// Recompute the symbol costs
+	// First consider that all the duplicated symbols are worth to keep
+	// and compute the number of bits to reference all that symbols
 
-		uint cost = 0;
-		node = sym_root.next;
-		while (node != &sym_root)
-			{
-			symbol_t * sym = structof (symbol_t, node, node);
-			cost += sym_cost_se (sym, 0);  // no select
-			node = node->next;
-			}
+	tab->keep_count = keep_dup (tab);
 
-		if (opt_verb) printf ("Frame cost: %u bytes\n\n", cost / 8);
+	if (opt_verb) printf ("Duplicated symbols: %u\n\n", tab->keep_count);
+	tab->ref_bit = (tab->keep_count > 1) ? log2u (tab->keep_count - 1) : 0;
 
-		// No need to go further when cost increases
-		if (cost >= min_cost) break;
+	// Evaluate the reference bits down to 0 to get the best one
 
-		best_keep = keep_count;
-		min_cost = cost;
-		best_bit = ref_bit;
+	uint best_keep = UINT_MAX;
+	uchar best_bit = cand_best (tab, eval_se, &best_keep);
 
-		// Save the best selection
+	if (opt_verb) printf ("Best bits: %u\n\n", best_bit);
 
-		node = sym_root.next;
-		while (node != &sym_root)
-			{
-			symbol_t * sym = structof (symbol_t, node, node);
-			sym->best_keep = sym->keep;
-			sym->best_len = sym->len;
-			node = node->next;
-			}
+	// The dictionary size must fit the references
 
-		ref_bit--;
+	if (!best_keep || best_keep > SYMBOL_MAX)
+		{
+		algo_fail = 1;
+		return;
 		}
 
-	if (opt_verb) printf ("Best bits: %u\n\n", best_bit);
+	est_cost += cost_pref_odd (best_keep - 1);  // dictionary size
 
 	// Restore the best selection
 
-	ref_bit = best_bit;
+	// The decoder gets the reference bits from the dictionary size,
+	// which can need less than the evaluated width
 
-	node = sym_root.next;
-	while (node != &sym_root)
-		{
-		symbol_t * sym = structof (symbol_t, node, node);
-		sym->keep = sym->best_keep;
-		sym->len = sym->best_len;
-		node = node->next;
-		}
+	ref_bit = log2u (best_keep - 1);
+
+	memcpy (tab->keep, tab->best_keep, tab->count * sizeof (uchar));
+	memcpy (tab->len, tab->best_len, tab->count * sizeof (uint));
+	table_store (tab);
+
+	uchar parsed = parse_best (0);
+	if (opt_dry) return;
 
 	// FIXME: truncating above to fit the reference bits
 	// discard some symbols with better gain than the kept ones.
@@ -561,7 +879,7 @@ static void compress_se ()
 
 	out_pref_odd (best_keep - 1);
 
-	node = sym_root.next;
+	list_t * node = sym_root.next;
 	while (node != &sym_root)
 		{
 		symbol_t * sym = structof (symbol_t, node, node);
@@ -578,12 +896,18 @@ static void compress_se ()
 
 	// Output frame
 
-	node = pos_root.next;
-	while (node != &pos_root)
+	if (parsed)
 		{
-		position_t * pos = structof (position_t, node, node);
-		out_sym_se (pos->sym, 0, 0, 0);  // outside a definition
-		node = node->next;
+		out_parse (0);
+		out_pad ();
+		return;
+		}
+
+	uint_t pos = pos_head;
+	while (pos != POS_NONE)
+		{
+		out_sym_se (pos_sym [pos], 0, 0, 0);  // outside a definition
+		pos = pos_next [pos];
 		}
 
 	out_pad ();
@@ -606,7 +930,7 @@ static void expand_se ()
 
 		// Iterate until next flag is false
 
-		uchar count = 0;
+		uint count = 0;
 		while (1)
 			{
 			uchar flag = in_bit (0);  // no shift - keep bit in input
@@ -627,8 +951,6 @@ static void expand_se ()
 
 	while (1)
 		{
-		// FIXME: not safe for small data
-		// as remaining bits can be useful
 		if (in_eof ()) break;
 
 		if (in_bit (1))  // index
@@ -648,9 +970,9 @@ static void expand_se ()
 // Compression with "symbol"
 // Embedded dictionary (internal)
 
-static uchar out_child_si (symbol_t * sym, uchar def_len, uchar def_now);
+static uint out_child_si (symbol_t * sym, uint def_len, uint def_now);
 
-static uchar out_sym_si (symbol_t * sym, uchar def_len, uchar def_now)
+static uint out_sym_si (symbol_t * sym, uint def_len, uint def_now)
 	{
 	if (sym->keep)
 		{
@@ -695,7 +1017,7 @@ static uchar out_sym_si (symbol_t * sym, uchar def_len, uchar def_now)
 	return def_now;
 	}
 
-static uchar out_child_si (symbol_t * sym, uchar def_len, uchar def_now)
+static uint out_child_si (symbol_t * sym, uint def_len, uint def_now)
 	{
 	if (sym->size == 1)
 		{
@@ -721,9 +1043,32 @@ static uchar out_child_si (symbol_t * sym, uchar def_len, uchar def_now)
 	}
 
 
+static void eval_si (cand_t * cand)
+	{
+	table_t * tab = &cand->tab;
+
+	// Drop the base symbols when too many index bits
+
+	if (tab->ref_bit > 6)
+		{
+		for (uint_t i = 0; i < tab->count; i++)
+			{
+			if (tab->size [i] == 1)
+				{
+				if (tab->keep [i]) tab->keep_count--;
+				tab->keep [i] = 0;
+				}
+			}
+		}
+
+	cand->worth = tab->keep_count;
+	cand->cost = keep_select_si (tab, 1u << tab->ref_bit);
+	}
+
+
 static void compress_si ()
 	{
-	crunch_word ();
+	crunch_grammar ();
 
 	if (opt_sym)
 		{
@@ -731,156 +1076,44 @@ static void compress_si ()
 		sym_list (LIST_ALL);
 		}
 
+	table_t * tab = &sym_table;
+	table_build (tab);
+
 	// First consider that all the duplicated symbols are worth to keep
 	// and compute the number of bits to reference all that symbols
 
-	keep_count = keep_dup ();
-	if (opt_verb) printf ("Duplicated symbols: %u\n\n", keep_count);
-	ref_bit = log2u (keep_count - 1);
-
-	uchar best_bit = UCHAR_MAX;
-	uint min_cost = UINT_MAX;
+	tab->keep_count = keep_dup (tab);
+	if (opt_verb) printf ("Duplicated symbols: %u\n\n", tab->keep_count);
+	tab->ref_bit = (tab->keep_count > 1) ? log2u (tab->keep_count - 1) : 0;
 
-	// Iterate on the reference bits down to 0 to get the best one
+	// Evaluate the reference bits down to 0 to get the best one
 
-	list_t * node;
-	uint keep_save = keep_count;
+	uint best_keep = UINT_MAX;
+	uchar best_bit = cand_best (tab, eval_si, &best_keep);
 
-	while (ref_bit > 0)
-		{
-		if (opt_verb) printf ("Reference bits: %u\n", ref_bit);
+	if (opt_verb) printf ("Best bits: %u\n\n", best_bit);
+	if (opt_dry) return;
 
-		// Save the symbol states
+	// Restore the best selection
 
-		node = sym_root.next;
-		while (node != &sym_root)
-			{
-			symbol_t * sym = structof (symbol_t, node, node);
-			sym->save_count = sym->sym_count;
-			sym->save_keep = sym->keep;
-			node = node->next;
-			}
+	memcpy (tab->keep, tab->best_keep, tab->count * sizeof (uchar));
+	memcpy (tab->len, tab->best_len, tab->count * sizeof (uint));
+	table_store (tab);
 
-		// Drop the base symbols when too many index bits
+	// Output the best selection
 
-		node = sym_root.next;
-		while (node != &sym_root)
-			{
-			symbol_t * sym = structof (symbol_t, node, node);
-			if (sym->size == 1 && ref_bit > 6)
-				{
-				if (sym->keep) keep_count--;
-				sym->keep = 0;
-				}
+	// Adapt reference bits to number of definitions
+	index_count = 0;
+	ref_bit = 0;
 
-			node = node->next;
-			}
+	uint_t pos = pos_head;
+	while (pos != POS_NONE)
+		{
+		out_sym_si (pos_sym [pos], 0, 0);  // 0 = currently outside a definition
+		pos = pos_next [pos];
+		}
 
-		if (opt_verb) printf ("Worth symbols: %u\n", keep_count);
-
-		uint keep_max = 1 << ref_bit;
-		uint cost = 0;
-
-		while (1)
-			{
-			// Compute the symbol costs and gains
-
-			symbol_t * sym_min = NULL;
-			int gain_min = INT_MAX;
-			cost = 0;
-
-			node = sym_root.next;
-			while (node != &sym_root)
-				{
-				symbol_t * sym = structof (symbol_t, node, node);
-				cost += sym_cost_si (sym);
-				if (sym->keep && sym->gain < gain_min)
-					{
-					sym_min = sym;
-					gain_min = sym->gain;
-					}
-
-				node = node->next;
-				}
-
-			if (keep_count <= keep_max) break;
-
-			sym_min->keep = 0;
-			keep_count--;
-
-			sym_drop (sym_min, sym_min->use_count - 1);
-			}
-
-		if (opt_verb)
-			{
-			printf ("Kept symbols: %u\n", keep_count);
-			printf ("Frame cost: %u bytes\n\n", cost / 8);
-			}
-
-		// No need to go further when cost increases
-		if (cost >= min_cost) break;
-
-		min_cost = cost;
-		best_bit = ref_bit;
-
-		// Save the best selection
-
-		node = sym_root.next;
-		while (node != &sym_root)
-			{
-			symbol_t * sym = structof (symbol_t, node, node);
-			sym->best_keep = sym->keep;
-			sym->best_len = sym->len;
-			node = node->next;
-			}
-
-		// Restore the symbol states
-
-		node = sym_root.next;
-		while (node != &sym_root)
-			{
-			symbol_t * sym = structof (symbol_t, node, node);
-			sym->sym_count = sym->save_count;
-			sym->use_count = sym->pos_count + sym->sym_count;
-			sym->keep = sym->save_keep;
-			node = node->next;
-			}
-
-		keep_count = keep_save;
-
-		ref_bit--;
-		}
-
-	if (opt_verb) printf ("Best bits: %u\n\n", best_bit);
-
-	// Restore the best selection
-
-	ref_bit = best_bit;
-
-	node = sym_root.next;
-	while (node != &sym_root)
-		{
-		symbol_t * sym = structof (symbol_t, node, node);
-		sym->keep = sym->best_keep;
-		sym->len = sym->best_len;
-		node = node->next;
-		}
-
-	// Output the best selection
-
-	// Adapt reference bits to number of definitions
-	index_count = 0;
-	ref_bit = 0;
-
-	node = pos_root.next;
-	while (node != &pos_root)
-		{
-		position_t * pos = structof (position_t, node, node);
-		out_sym_si (pos->sym, 0, 0);  // 0 = currently outside a definition
-		node = node->next;
-		}
-
-	out_pad ();
+	out_pad ();
 
 	def_count = index_count;
 	}
@@ -920,7 +1153,7 @@ static uint_t in_elem ()
 
 			// Iterate until next flag is false
 
-			uchar count = 0;
+			uint count = 0;
 			while (1)
 				{
 				uchar flag = in_bit (0);  // no shift - keep bit in input
@@ -955,8 +1188,6 @@ static void expand_si ()
 
 	while (1)
 		{
-		// FIXME: not safe for small data
-		// as remaining bits can be useful
 		if (in_eof ()) break;
 		in_elem ();
 		}
@@ -966,128 +1197,100 @@ static void expand_si ()
 // Compression with "repeated symbol"
 // Prepended dictionary (external)
 
-static void compress_rse ()
+static void eval_rse (cand_t * cand)
 	{
-	crunch_word ();
-	crunch_rep ();
+	table_t * tab = &cand->tab;
 
-	if (opt_sym)
-		{
-		sym_sort (SORT_ALL);
-		sym_list (LIST_ALL);
-		}
+	// Compute the symbol costs
 
-	// First consider that all the duplicated symbols are worth to keep
-	// and compute the number of bits to reference all that symbols
+	tab->keep_count = 0;
 
-	keep_count = keep_dup ();
+	for (uint_t i = 0; i < tab->count; i++)
+		{
+		if (!tab->repeat [i]) sym_cost_rse (tab, i, 1);  // select
+		}
 
-	if (opt_verb) printf ("Duplicated symbols: %u\n\n", keep_count);
-	ref_bit = log2u (keep_count - 1);
+	cand->worth = tab->keep_count;
 
-	uchar best_bit = UCHAR_MAX;
-	uint best_keep = UINT_MAX;
-	uint min_cost = UINT_MAX;
+	// Discard worthless
 
-	// Iterate on the reference bits down to 0 to get the best one
+	keep_trunc (tab, 1u << tab->ref_bit);
 
-	list_t * node;
+	// Recompute the symbol costs
 
-	while (ref_bit > 0)
+	uint cost = 0;
+	for (uint_t i = 0; i < tab->count; i++)
 		{
-		if (opt_verb) printf ("Reference bits: %u\n", ref_bit);
-
-		// Compute the symbol costs
+		uint_t left = tab->left [i];
 
-		keep_count = 0;
-
-		node = sym_root.next;
-		while (node != &sym_root)
-			{
-			symbol_t * sym = structof (symbol_t, node, node);
-			if (!sym->repeat) sym_cost_rse (sym, 1);  // select
-			node = node->next;
-			}
-
-		if (opt_verb) printf ("Worth symbols: %u\n", keep_count);
-
-		// Discard worthless
+		if (!tab->repeat [i])
+			cost += sym_cost_rse (tab, i, 0);  // no select
+		else if (tab->keep [left] || tab->size [left] == 1)
+			cost += tab->pos_count [i] * (2 + cost_pref_odd (tab->rep_count [i] - 2));
+		}
 
-		sym_sort (SORT_GAIN);
+	cand->cost = cost;
+	}
 
-		uint keep_max = 1 << ref_bit;
-		if (keep_count > keep_max)
-			{
-			for (uint i = keep_max; i < keep_count; i++)
-				{
-				index_sym_t * index = index_sym + i;
-				symbol_t * sym = index->sym;
-				sym->keep = 0;
-				}
 
-			keep_count = keep_max;
-			}
+static void compress_rse ()
+	{
+	crunch_grammar ();
+	crunch_rep ();
 
-		if (opt_verb) printf ("Kept symbols: %u\n", keep_count);
+	if (opt_sym)
+		{
+		sym_sort (SORT_ALL);
+		sym_list (LIST_ALL);
+		}
 
-		// Recompute the symbol costs
+	table_t * tab = &sym_table;
+	table_build (tab);
 
-		uint cost = 0;
-		node = sym_root.next;
-		while (node != &sym_root)
-			{
-			symbol_t * sym = structof (symbol_t, node, node);
-			if (!sym->repeat)
-				cost += sym_cost_rse (sym, 0);  // no select
-			else if (sym->left->keep || sym->left->size == 1)
-				cost += 2 + cost_pref_odd (sym->rep_count - 2);
+	// First consider that all the duplicated symbols are worth to keep
+	// and compute the number of bits to reference all that symbols
 
-			node = node->next;
-			}
+	tab->keep_count = keep_dup (tab);
 
-		if (opt_verb) printf ("Frame cost: %u bytes\n\n", cost / 8);
+	if (opt_verb) printf ("Duplicated symbols: %u\n\n", tab->keep_count);
+	tab->ref_bit = (tab->keep_count > 1) ? log2u (tab->keep_count - 1) : 0;
 
-		// No need to go further when cost increases
-		if (cost >= min_cost) break;
+	// Evaluate the reference bits down to 0 to get the best one
 
-		best_keep = keep_count;
-		min_cost = cost;
-		best_bit = ref_bit;
+	uint best_keep = UINT_MAX;
+	uchar best_bit = cand_best (tab, eval_rse, &best_keep);
 
-		// Save the best selection
+	if (opt_verb) printf ("Best bits: %u\n\n", best_bit);
 
-		node = sym_root.next;
-		while (node != &sym_root)
-			{
-			symbol_t * sym = structof (symbol_t, node, node);
-			sym->best_keep = sym->keep;
-			sym->best_len = sym->len;
-			node = node->next;
-			}
+	// The dictionary size must fit the references
 
-		ref_bit--;
+	if (!best_keep || best_keep > SYMBOL_MAX)
+		{
+		algo_fail = 1;
+		return;
 		}
 
-	if (opt_verb) printf ("Best bits: %u\n\n", best_bit);
+	est_cost += cost_pref_odd (best_keep - 1);  // dictionary size
 
 	// Restore the best selection
 
-	ref_bit = best_bit;
+	// The decoder gets the reference bits from the dictionary size,
+	// which can need less than the evaluated width
 
-	node = sym_root.next;
-	while (node != &sym_root)
-		{
-		symbol_t * sym = structof (symbol_t, node, node);
-		sym->keep = sym->best_keep;
-		sym->len = sym->best_len;
-		node = node->next;
-		}
+	ref_bit = log2u (best_keep - 1);
+
+	memcpy (tab->keep, tab->best_keep, tab->count * sizeof (uchar));
+	memcpy (tab->len, tab->best_len, tab->count * sizeof (uint));
+	table_store (tab);
+
+	uchar parsed = parse_best (1);
+	if (opt_dry) return;
 
 	// Output the dictionary
 
 	out_pref_odd (best_keep - 1);
 
-	node = sym_root.next;
+	list_t * node = sym_root.next;
 	while (node != &sym_root)
 		{
 		symbol_t * sym = structof (symbol_t, node, node);
@@ -1102,11 +1305,17 @@ static void compress_rse ()
 
 	def_count = best_keep;
 
-	node = pos_root.next;
-	while (node != &pos_root)
+	if (parsed)
+		{
+		out_parse (1);
+		out_pad ();
+		return;
+		}
+
+	uint_t pos = pos_head;
+	while (pos != POS_NONE)
 		{
-		position_t * pos = structof (position_t, node, node);
-		symbol_t * sym = pos->sym;
+		symbol_t * sym = pos_sym [pos];
 
 		uint rep = sym->rep_count;
 		if (sym->repeat)
@@ -1131,7 +1340,7 @@ static void compress_rse ()
 			out_sym_se (sym, 0, 0, 1);  // outside a definition - at position
 			}
 
-		node = node->next;
+		pos = pos_next [pos];
 		}
 
 	out_pad ();
@@ -1156,7 +1365,7 @@ static void expand_rse ()
 
 		// Iterate until next flag is false
 
-		uchar count = 0;
+		uint count = 0;
 		while (1)
 			{
 			uchar flag = in_bit (0);  // no shift - keep bit in input
@@ -1177,8 +1386,6 @@ static void expand_rse ()
 
 	while (1)
 		{
-		// FIXME: not safe for small data
-		// as remaining bits can be useful
 		if (in_eof ()) break;
 
 		if (in_bit (1))
@@ -1217,13 +1424,343 @@ static void expand_rse ()
 	}
 
 
+//------------------------------------------------------------------------------
+// Portfolio
+//------------------------------------------------------------------------------
+
+static void compress_algo (uchar algo)
+	{
+	switch (algo)
+		{
+		case ALGO_BASE:
+			compress_b ();
+			break;
+
+		case ALGO_REP_BASE:
+			compress_rb ();
+			break;
+
+		case ALGO_PREF:
+			compress_pb ();
+			break;
+
+		case ALGO_REP_PREF:
+			compress_rpb ();
+			break;
+
+		case ALGO_SYM_EXT:
+			compress_se ();
+			break;
+
+		case ALGO_SYM_INT:
+			compress_si ();
+			break;
+
+		case ALGO_REP_SE:
+			compress_rse ();
+			break;
+
+		default:
+			compress_rse ();
+			break;
+
+		}
+	}
+
+
+// All the algorithms run in parallel and the smallest output is kept
+// As the encoders work on global state, each algorithm runs
+// in a child process on its own copy and sends its output in a pipe
+// The symbol algorithms can also run once per tie-break policy
+
+#define ALGO_COUNT 7
+#define PORT_MAX (ALGO_COUNT + 3 * (TIE_MAX - 1))
+
+static const char * port_names [ALGO_COUNT] =
+	{ "b", "rb", "pb", "rpb", "se", "si", "rse" };
+
+struct port_s
+	{
+	uchar algo;
+	uint_t tie;  // tie-break policy
+	pid_t pid;
+	int fd;      // output pipe
+	uint_t size;
+	};
+
+typedef struct port_s port_t;
+
+static port_t ports [PORT_MAX];
+static uchar_t port_frame [FRAME_OUT_MAX];
+
+
+// Start an algorithm on the current state
+
+static void port_start (port_t * port, uchar algo, uint_t tie)
+	{
+	int fds [2];
+	if (pipe (fds)) error (1, errno, "pipe failed");
+
+	fflush (stdout);
+
+	pid_t pid = fork ();
+	if (pid < 0) error (1, errno, "fork failed");
+
+	if (!pid)
+		{
+		close (fds [0]);
+
+		opt_verb = 0;
+		opt_sym = 0;
+
+		// The grammar cache holds the default policy only
+		crunch_tie = tie;
+		if (tie != TIE_OLD) opt_grammar = NULL;
+
+		size_out = 0;
+		out_byte (algo);  // frame header
+		compress_algo (algo);
+		if (algo_fail) _exit (1);
+
+		uint_t done = 0;
+		while (done < size_out)
+			{
+			ssize_t len = write (fds [1], frame_out + done, size_out - done);
+			if (len <= 0) _exit (1);
+			done += len;
+			}
+
+		_exit (0);
+		}
+
+	close (fds [1]);
+
+	port->algo = algo;
+	port->tie = tie;
+	port->pid = pid;
+	port->fd = fds [0];
+	port->size = 0;
+	}
+
+
+// Get the output of an algorithm
+// Returns 0 when the algorithm failed
+
+static uchar port_wait (port_t * port)
+	{
+	uint_t size = 0;
+
+	while (1)
+		{
+		if (size >= FRAME_OUT_MAX) error (1, 0, "portfolio overflow");
+
+		ssize_t len = read (port->fd, port_frame + size, FRAME_OUT_MAX - size);
+		if (len < 0) error (1, errno, "pipe failed");
+		if (!len) break;
+
+		size += len;
+		}
+
+	close (port->fd);
+
+	int status;
+	if (waitpid (port->pid, &status, 0) < 0) error (1, errno, "wait failed");
+
+	port->size = size;
+	return WIFEXITED (status) && !WEXITSTATUS (status) && size;
+	}
+
+
+// The base algorithms run on the sequence of base symbols
+// and the symbol algorithms share the crunched grammar,
+// unless each tie-break policy crunches its own
+// Ties are won by the simplest algorithm and the default policy
+
+static void compress_port (uchar algo)
+	{
+	uint_t count = 0;
+
+	uchar first = algo;
+	uchar last = algo;
+
+	if (algo == ALGO_AUTO)
+		{
+		for (uchar a = ALGO_BASE; a < ALGO_SYM_EXT; a++)
+			port_start (ports + count++, a, TIE_OLD);
+
+		first = ALGO_SYM_EXT;
+		last = ALGO_REP_SE;
+		}
+
+	if (opt_ties == 1) crunch_grammar ();
+
+	for (uchar a = first; a <= last; a++)
+		{
+		for (uint_t t = 0; t < opt_ties; t++)
+			port_start (ports + count++, a, t);
+		}
+
+	port_t * best = NULL;
+
+	for (uint_t p = 0; p < count; p++)
+		{
+		port_t * port = ports + p;
+		if (!port_wait (port)) continue;
+
+		if (opt_verb)
+			{
+			printf ("Algorithm %s", port_names [port->algo - 1]);
+			if (opt_ties > 1) printf (" tie %u", port->tie);
+			printf (": %u bytes\n", port->size);
+			}
+
+		if (!best || port->size < best->size)
+			{
+			best = port;
+
+			memcpy (frame_out, port_frame, port->size);
+			size_out = port->size;
+			}
+		}
+
+	if (!best) error (1, 0, "all algorithms failed");
+
+	if (opt_verb)
+		{
+		printf ("Best algorithm: %s\n", port_names [best->algo - 1]);
+		if (opt_ties > 1) printf ("Best tie-break: %u\n", best->tie);
+		putchar ('\n');
+		}
+	}
+
+
+//------------------------------------------------------------------------------
+// Size estimate
+//------------------------------------------------------------------------------
+
+// Estimate the output size of the symbol algorithms from their cost model
+// The selection is run as for the compression, but nothing is output
+// All the symbol algorithms by default, on the same grammar
+
+static uint est_size ()
+	{
+	uint size = FRAME_HEAD + (est_cost + 7) / 8;
+
+	// Stored when larger
+	if (size > FRAME_HEAD + size_in) size = FRAME_HEAD + size_in;
+
+	return size;
+	}
+
+// Each algorithm starts from a null cost
+// and a frame it cannot encode is stored
+
+static void est_algo (const char * name, void (* compress) ())
+	{
+	est_cost = 0;
+	algo_fail = 0;
+
+	compress ();
+
+	if (algo_fail)
+		printf ("%-4s %u bytes (stored, the algorithm fails)\n", name, FRAME_HEAD + size_in);
+	else
+		printf ("%-4s %u bytes (estimated)\n", name, est_size ());
+	}
+
+static void estimate ()
+	{
+	uchar all = opt_algo == ALGO_DEF || opt_algo == ALGO_AUTO;
+
+	if (all || opt_algo == ALGO_SYM_EXT) est_algo ("se", compress_se);
+	if (all || opt_algo == ALGO_SYM_INT) est_algo ("si", compress_si);
+
+	// Last as the repeat crunch changes the grammar
+
+	if (all || opt_algo == ALGO_REP_SE) est_algo ("rse", compress_rse);
+	}
+
+
+//------------------------------------------------------------------------------
+// Output cache
+//------------------------------------------------------------------------------
+
+// Cache file named by the frame hash and size, the settings that shape the output
+// and the output version, to bump whenever the encoders or the frame format change
+
+#define CACHE_VERSION 1
+
+static void cache_name (char * name, size_t size)
+	{
+	snprintf (name, size, "%s/%016llx-s%u-v%u-a%u-p%u-b%u-r%u-w%u-t%u.bin", opt_cache,
+		hash_frame (frame_in, size_in), size_in, CACHE_VERSION, opt_algo,
+		crunch_min, crunch_batch, width_count, seed_len, opt_ties);
+	}
+
+
+// Load a cached output in the output frame
+
+static uchar cache_get (const char * name)
+	{
+	FILE * file = fopen (name, "r");
+	if (!file) return 0;
+
+	size_t size = fread (frame_out, sizeof (uchar_t), FRAME_OUT_MAX, file);
+	uchar ok = size && !ferror (file);
+	fclose (file);
+
+	if (ok) size_out = size;
+	return ok;
+	}
+
+
+// Store the output frame in the cache
+// Renamed when complete, so that a concurrent build never reads a partial file
+// The cache is best effort: a failure is only a warning
+
+static void cache_put (const char * name)
+	{
+	char temp [PATH_MAX + 16];  // room for the process identifier
+	snprintf (temp, sizeof (temp), "%s.%u", name, (uint) getpid ());
+
+	FILE * file = fopen (temp, "w");
+	if (!file)
+		{
+		error (0, errno, "cache store failed");
+		return;
+		}
+
+	size_t size = fwrite (frame_out, sizeof (uchar_t), size_out, file);
+	uchar ok = (size == size_out) && !ferror (file);
+	if (fclose (file)) ok = 0;
+
+	if (!ok || rename (temp, name))
+		{
+		error (0, errno, "cache store failed");
+		unlink (temp);
+		}
+	}
+
+
 //------------------------------------------------------------------------------
 // Main entry point
 //------------------------------------------------------------------------------
 
+static const struct option long_opts [] =
+	{
+	{ "budget-ms", required_argument, NULL, 'B' },
+	{ "cache-dir", required_argument, NULL, 'C' },
+	{ "level",     required_argument, NULL, 'l' },
+	{ "ties",      required_argument, NULL, 'T' },
+	{ "warm",      required_argument, NULL, 'W' },
+	{ NULL,        0,                 NULL, 0 }
+	};
+
 int main (int argc, char * argv [])
 	{
 	clock_t clock_begin = clock ();
+	uint level = LEVEL_MAX;
+	uint batch = 0;
 
 	while (1)
 		{
@@ -1231,11 +1768,29 @@ int main (int argc, char * argv [])
 
 		while (1)
 			{
-			opt = getopt (argc, argv, "cem:stv");
+			opt = getopt_long (argc, argv, "b:C:ceg:j:l:m:nstvw:", long_opts, NULL);
 			if (opt < 0 || opt == '?') break;
 
 			switch (opt)
 				{
+				case 'b':  // batch
+					batch = atoi (optarg);
+					if (batch < 1 || batch > CRUNCH_BATCH_MAX)
+						error (1, 0, "bad batch count");
+
+					break;
+
+				case 'B':  // time budget
+					opt_budget = atoi (optarg);
+					if (opt_budget < 1)
+						error (1, 0, "bad time budget");
+
+					break;
+
+				case 'C':  // output cache
+					opt_cache = optarg;
+					break;
+
 				case 'c':  // compress
 					opt_compress = 1;
 					break;
@@ -1244,6 +1799,24 @@ int main (int argc, char * argv [])
 					opt_expand = 1;
 					break;
 
+				case 'g':  // grammar cache
+					opt_grammar = optarg;
+					break;
+
+				case 'j':  // threads
+					thread_count = atoi (optarg);
+					if (thread_count < 1 || thread_count > THREAD_MAX)
+						error (1, 0, "bad thread count");
+
+					break;
+
+				case 'l':  // level
+					level = atoi (optarg);
+					if (level < 1 || level > LEVEL_MAX)
+						error (1, 0, "bad level");
+
+					break;
+
 				case 'm':  // algorithm
 					if (!strcmp (optarg, "b"))
 						opt_algo = ALGO_BASE;
@@ -1259,11 +1832,17 @@ int main (int argc, char * argv [])
 						opt_algo = ALGO_SYM_INT;
 					else if (!strcmp (optarg, "rse"))
 						opt_algo = ALGO_REP_SE;
+					else if (!strcmp (optarg, "auto"))
+						opt_algo = ALGO_AUTO;
 					else
 						error (1, 0, "unknown algorithm");
 
 					break;
 
+				case 'n':  // size estimate
+					opt_dry = 1;
+					break;
+
 				case 's':  // list symbols
 					opt_sym = 1;
 					break;
@@ -1276,18 +1855,52 @@ int main (int argc, char * argv [])
 					opt_verb = 1;
 					break;
 
+				case 'w':  // seed words
+					seed_len = atoi (optarg);
+					if (seed_len < 2 || seed_len > FRAME_MAX)
+						error (1, 0, "bad word length");
+
+					break;
+
+				case 'T':  // tie-break policies
+					opt_ties = atoi (optarg);
+					if (opt_ties < 1 || opt_ties > TIE_MAX)
+						error (1, 0, "bad tie-break count");
+
+					break;
+
+				case 'W':  // warm start
+					opt_warm = optarg;
+					break;
+
 				}
 			}
 
-		if (opt == '?' || optind != argc - 2 || (opt_compress == opt_expand))
+		// No output file for an estimate
+
+		uint_t arg_count = argc - optind;
+		if (opt_dry && arg_count == 1) arg_count = 2;
+
+		if (opt == '?' || arg_count != 2 || (opt_compress == opt_expand))
 			{
-			printf ("usage: %s (-c | -d) [-sv] [-m <algo>] <input file> <output file>\n\n", argv [0]);
+			printf ("usage: %s (-c | -d) [-nstv] [-b <count>] [-C <dir>] [-g <file>] [-j <threads>] [-l <level>] [-m <algo>] [-w <length>] <input file> <output file>\n\n", argv [0]);
+			puts ("  -b  pairs crunched per round (1 = strict)");
+			puts ("  -C  output cache directory (same as --cache-dir)");
 			puts ("  -c  compress");
 			puts ("  -e  expand");
-			puts ("  -m  algorithm");
+			puts ("  -g  grammar cache file");
+			puts ("  -j  worker threads");
+			puts ("  -l  level from 1 (fast) to 9 (best, default)");
+			puts ("  -m  algorithm (given by the frame header on expansion)");
+			puts ("  -n  estimate the size without output (all symbol algorithms by default)");
 			puts ("  -s  list symbols");
 			puts ("  -t  timing");
 			puts ("  -v  verbose");
+			puts ("  -w  seed repeated words of at least length");
+			puts ("  --budget-ms <msecs>  stop crunching pairs after the wall time");
+			puts ("  --cache-dir <dir>    reuse the outputs of the same inputs and options");
+			puts ("  --ties <count>       keep the best of crunches with different tie-breaks");
+			puts ("  --warm <file>        start from the grammar file of a previous version");
 			puts ("");
 			puts ("algorithms:");
 			puts ("  b    base (no compression)");
@@ -1297,10 +1910,25 @@ int main (int argc, char * argv [])
 			puts ("  se   symbol external (prepended dictionary)");
 			puts ("  si   symbol internal (embedded dictionary)");
 			puts ("  rse  repeat symbol external (default)");
+			puts ("  auto smallest of all the algorithms");
 			puts ("");
 			break;
 			}
 
+		if (opt_dry && opt_algo != ALGO_DEF && opt_algo < ALGO_SYM_EXT)
+			error (1, 0, "no size estimate for the algorithm");
+
+		// Apply the level
+		// An explicit batch count takes precedence
+
+		const level_t * lev = levels + level;
+
+		crunch_min = lev->pair_min;
+		crunch_batch = batch ? batch : lev->batch;
+		width_count = lev->width_count;
+
+		crunch_budget = opt_budget;
+
 		in_frame (argv [optind]);
 
 		if (opt_compress)
@@ -1308,6 +1936,28 @@ int main (int argc, char * argv [])
 			if (size_in < 3)
 				error (1, 0, "frame too short");
 
+			if (size_in > FRAME_MAX)
+				error (1, 0, "frame too long");
+
+			// Look the output up in the cache
+			// Not with a time budget, as the output is not repeatable,
+			// nor with a warm start, as the output depends on the previous grammar
+
+			char cache_path [PATH_MAX];
+			uchar cache = opt_cache && !opt_budget && !opt_warm && !opt_dry;
+
+			if (cache)
+				{
+				cache_name (cache_path, sizeof (cache_path));
+				if (cache_get (cache_path))
+					{
+					if (opt_verb) puts ("Cache hits: 1\nCache misses: 0\n");
+
+					out_frame (argv [optind + 1]);
+					break;
+					}
+				}
+
 			scan_base ();
 
 			if (opt_verb)
@@ -1323,43 +1973,38 @@ int main (int argc, char * argv [])
 				sym_list (LIST_ALL);
 				}
 
-			if (opt_verb) puts ("Compressing...\n");
-
-			switch (opt_algo)
+			if (opt_dry)
 				{
-				case ALGO_BASE:
-					compress_b ();
-					break;
+				if (opt_verb) puts ("Estimating...\n");
 
-				case ALGO_REP_BASE:
-					compress_rb ();
-					break;
-
-				case ALGO_PREF:
-					compress_pb ();
-					break;
+				estimate ();
+				break;
+				}
 
-				case ALGO_REP_PREF:
-					compress_rpb ();
-					break;
+			if (opt_verb) puts ("Compressing...\n");
 
-				case ALGO_SYM_EXT:
-					compress_se ();
-					break;
+			// Store random frames without crunch
 
-				case ALGO_SYM_INT:
-					compress_si ();
-					break;
+			uchar algo = (opt_algo == ALGO_DEF) ? ALGO_REP_SE : opt_algo;
+			uchar random = algo != ALGO_BASE && scan_random ();
 
-				case ALGO_REP_SE:
-					compress_rse ();
-					break;
+			if (!random)
+				{
+				if (algo == ALGO_AUTO || (opt_ties > 1 && algo >= ALGO_SYM_EXT))
+					{
+					compress_port (algo);
+					}
+				else
+					{
+					out_byte (algo);  // frame header
+					compress_algo (algo);
+					}
+				}
 
-				default:
-					compress_rse ();
-					break;
+			// Never more than the stored frame, nor a failed one
 
-				}
+			uchar stored = random || algo_fail || size_out > FRAME_HEAD + size_in;
+			if (stored) store_frame ();
 
 			if (opt_verb)
 				{
@@ -1372,11 +2017,39 @@ int main (int argc, char * argv [])
 				printf ("Ref count: %u\n", ref_count);
 				printf ("Rep count: %u\n", rep_count);
 
+				if (seed_count)
+					printf ("Seeded words: %u (%u bytes)\n", seed_count, seed_size);
+
+				if (crunch_round)
+					{
+					printf ("Crunch rounds: %u\n", crunch_round);
+					printf ("Crunched pairs: %u\n", crunch_count);
+					}
+
+				if (crunch_left)
+					printf ("Crunch stopped at pair count: %u\n", crunch_left);
+
+				if (stored)
+					printf ("Stored frame: %s\n", random ? "random bytes" : algo_fail ? "algorithm failed" : "no gain");
+
+				if (cache)
+					puts ("Cache hits: 0\nCache misses: 1");
+
+				// Estimate error of the cost model
+
+				if (est_cost)
+					{
+					printf ("Estimated size: %u\n", est_size ());
+					printf ("Estimate error: %+d\n", (int) est_size () - (int) size_out);
+					}
+
 				double ratio = (double) size_out / size_in;
 				printf ("Compression ratio: %f\n\n", ratio);
 				}
 
 			out_frame (argv [optind + 1]);
+
+			if (cache) cache_put (cache_path);
 			break;
 			}
 
@@ -1384,7 +2057,11 @@ int main (int argc, char * argv [])
 			{
 			if (opt_verb) printf ("Expanding...");
 
-			switch (opt_algo)
+			// The frame header selects the algorithm
+
+			uchar algo = size_in ? in_byte () : ALGO_DEF;
+
+			switch (algo)
 				{
 				case ALGO_BASE:
 					expand_b ();
@@ -1415,7 +2092,7 @@ int main (int argc, char * argv [])
 					break;
 
 				default:
-					expand_se ();
+					error (1, 0, "bad frame header");
 					break;
 
 				}
@@ -0,0 +1,480 @@
+//------------------------------------------------------------------------------
+// Grammar cache
+//------------------------------------------------------------------------------
+
+#include <string.h>
+#include <error.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "list.h"
+#include "stream.h"
+#include "symbol.h"
+#include "grammar.h"
+
+
+// File layout
+// Header, then symbols in creation order, then the sequence of symbols
+// The sequence positions follow from the symbol sizes,
+// and the symbol bases from their first occurrence in the sequence
+
+#define GRAMMAR_MAGIC   0x32524D47  // "GMR2"
+#define GRAMMAR_NONE    ((uint_t) -1)
+#define GRAMMAR_BASE    ((ushort_t) -1)  // left child of a base symbol
+
+struct grammar_head_s
+	{
+	uint_t  magic;
+	uint_t  size;       // frame size
+	ulong_t hash;       // frame hash
+
+	uint_t  pair_min;   // crunch settings
+	uint_t  batch;
+	uint_t  seed_len;
+	uint_t  tie;
+	uint_t  warm;       // warm started
+
+	uint_t  sym_count;
+	uint_t  pos_count;
+	};
+
+typedef struct grammar_head_s grammar_head_t;
+
+// The children are created before their parent,
+// so no symbol has the last identifier as child
+
+struct grammar_sym_s
+	{
+	ushort_t left;   // left child or none for a base symbol
+	ushort_t right;  // right child or code of a base symbol
+	};
+
+typedef struct grammar_sym_s grammar_sym_t;
+
+static grammar_sym_t syms [SYMBOL_MAX];
+static ushort_t seq [FRAME_MAX];
+static symbol_t * sym_id [SYMBOL_MAX];
+
+
+static void head_init (grammar_head_t * head, uchar warm)
+	{
+	memset (head, 0, sizeof (grammar_head_t));
+
+	head->magic = GRAMMAR_MAGIC;
+	head->size = size_in;
+	head->hash = hash_frame (frame_in, size_in);
+
+	head->pair_min = crunch_min;
+	head->batch = crunch_batch;
+	head->seed_len = seed_len;
+	head->tie = crunch_tie;
+	head->warm = warm;
+	}
+
+
+void grammar_save (const char * name, uchar warm)
+	{
+	grammar_head_t head;
+	head_init (&head, warm);
+
+	head.sym_count = sym_count;
+	head.pos_count = pos_count;
+
+	list_t * node = sym_root.next;
+	for (uint_t i = 0; i < sym_count; i++)
+		{
+		symbol_t * sym = structof (symbol_t, node, node);
+		grammar_sym_t * gs = syms + i;
+
+		if (sym->size == 1)
+			{
+			gs->left = GRAMMAR_BASE;
+			gs->right = sym->code;
+			}
+		else
+			{
+			gs->left = sym->left->id;
+			gs->right = sym->right->id;
+			}
+
+		node = node->next;
+		}
+
+	uint_t count = 0;
+	uint_t pos = pos_head;
+	while (pos != POS_NONE)
+		{
+		seq [count++] = pos_sym [pos]->id;
+		pos = pos_next [pos];
+		}
+
+	// Renamed when complete, as parallel crunches can save the same file
+
+	char temp [PATH_MAX + 16];  // room for the process identifier
+	snprintf (temp, sizeof (temp), "%s.%u", name, (uint) getpid ());
+
+	FILE * file = fopen (temp, "w");
+	if (!file) error (1, errno, "open failed");
+
+	fwrite (&head, sizeof (grammar_head_t), 1, file);
+	fwrite (syms, sizeof (grammar_sym_t), sym_count, file);
+	fwrite (seq, sizeof (ushort_t), pos_count, file);
+
+	if (ferror (file)) error (1, errno, "store failed");
+	fclose (file);
+
+	if (rename (temp, name)) error (1, errno, "store failed");
+	}
+
+
+// Read the header, the symbols and the sequence
+// Returns 0 when the file is missing or truncated
+
+static uchar grammar_read (const char * name, grammar_head_t * head)
+	{
+	FILE * file = fopen (name, "r");
+	if (!file) return 0;
+
+	uchar ok = fread (head, sizeof (grammar_head_t), 1, file) == 1
+		&& head->magic == GRAMMAR_MAGIC
+		&& head->size <= FRAME_MAX
+		&& head->sym_count <= SYMBOL_MAX && head->pos_count <= head->size
+		&& fread (syms, sizeof (grammar_sym_t), head->sym_count, file) == head->sym_count
+		&& fread (seq, sizeof (ushort_t), head->pos_count, file) == head->pos_count;
+
+	fclose (file);
+	return ok;
+	}
+
+
+// Frame of a grammar file
+
+static uchar_t gram_frame [FRAME_MAX];  // frame of the grammar
+static uint_t seq_off [FRAME_MAX];       // offset of sequence symbol
+
+static uint_t sym_size [SYMBOL_MAX];
+static uint_t sym_off [SYMBOL_MAX];    // offset of first occurrence
+
+
+// Expand a symbol of the grammar in its frame
+// The symbols already expanded are copied
+
+static void grammar_expand (uint_t id, uint_t off)
+	{
+	if (sym_off [id] != GRAMMAR_NONE)
+		{
+		memcpy (gram_frame + off, gram_frame + sym_off [id], sym_size [id]);
+		return;
+		}
+
+	sym_off [id] = off;
+
+	grammar_sym_t * gs = syms + id;
+	if (gs->left == GRAMMAR_BASE)
+		{
+		gram_frame [off] = gs->right;
+		return;
+		}
+
+	grammar_expand (gs->left, off);
+	grammar_expand (gs->right, off + sym_size [gs->left]);
+	}
+
+
+// Check the tree and the sequence of a grammar
+// and rebuild its frame
+// Returns 0 when not valid
+
+static uchar grammar_frame (const grammar_head_t * head)
+	{
+	uint_t count = head->sym_count;
+
+	// Check the tree and size the symbols
+
+	for (uint_t i = 0; i < count; i++)
+		{
+		grammar_sym_t * gs = syms + i;
+
+		if (gs->left == GRAMMAR_BASE)
+			{
+			if (gs->right >= CODE_MAX) return 0;
+			sym_size [i] = 1;
+			}
+		else
+			{
+			if (gs->left >= i || gs->right >= i) return 0;
+			sym_size [i] = sym_size [gs->left] + sym_size [gs->right];
+			if (sym_size [i] > FRAME_MAX) return 0;
+			}
+
+		sym_off [i] = GRAMMAR_NONE;
+		sym_id [i] = NULL;
+		}
+
+	// Expand the sequence
+
+	uint_t off = 0;
+
+	for (uint_t k = 0; k < head->pos_count; k++)
+		{
+		uint_t id = seq [k];
+		if (id >= count || off + sym_size [id] > head->size) return 0;
+
+		seq_off [k] = off;
+		grammar_expand (id, off);
+
+		off += sym_size [id];
+		}
+
+	return off == head->size;
+	}
+
+
+// Set the base of a symbol and its children
+// at their first occurrence in the sequence
+
+static void grammar_base (symbol_t * sym, uint_t pos)
+	{
+	if (sym->base != GRAMMAR_NONE) return;
+	sym->base = pos;
+
+	if (sym->size == 1) return;
+
+	grammar_base (sym->left, pos);
+	grammar_base (sym->right, pos + sym->left->size);
+	}
+
+
+// Returns 0 when the file is missing, not valid or does not match
+// the frame and the crunch settings
+
+uchar grammar_load (const char * name, uchar warm)
+	{
+	grammar_head_t head;
+	grammar_head_t want;
+	head_init (&want, warm);
+
+	if (!grammar_read (name, &head)
+		|| head.size != want.size || head.hash != want.hash
+		|| head.pair_min != want.pair_min || head.batch != want.batch
+		|| head.seed_len != want.seed_len
+		|| head.tie != want.tie || head.warm != want.warm)
+		return 0;
+
+	// The grammar must expand to the frame with all its symbols
+
+	if (!grammar_frame (&head) || memcmp (gram_frame, frame_in, size_in))
+		return 0;
+
+	for (uint_t i = 0; i < head.sym_count; i++)
+		if (sym_off [i] == GRAMMAR_NONE) return 0;
+
+	// Rebuild the symbols, counted in the tree by their parents
+
+	sym_reset ();
+
+	for (uint_t i = 0; i < head.sym_count; i++)
+		{
+		grammar_sym_t * gs = syms + i;
+		symbol_t * sym;
+
+		if (gs->left == GRAMMAR_BASE)
+			{
+			sym = sym_add ();
+
+			sym->code = gs->right;
+			sym->base = GRAMMAR_NONE;
+			sym->size = 1;
+			}
+		else
+			{
+			sym = sym_derive (sym_id [gs->left], sym_id [gs->right], GRAMMAR_NONE);
+			}
+
+		sym_id [i] = sym;
+		}
+
+	// Rebuild the sequence at the frame offsets
+
+	for (uint_t p = 0; p < size_in; p++)
+		pos_sym [p] = NULL;
+
+	uint_t pos = 0;
+	uint_t prev = POS_NONE;
+
+	for (uint_t i = 0; i < head.pos_count; i++)
+		{
+		symbol_t * sym = sym_id [seq [i]];
+		sym->pos_count++;
+		grammar_base (sym, pos);
+
+		pos_sym [pos] = sym;
+		pos_prev [pos] = prev;
+		if (prev != POS_NONE) pos_next [prev] = pos;
+
+		prev = pos;
+		pos += sym->size;
+		}
+
+	pos_next [prev] = POS_NONE;
+	pos_head = head.pos_count ? 0 : POS_NONE;
+	pos_count = head.pos_count;
+
+	return 1;
+	}
+
+
+// Warm start from the grammar of a previous frame
+// The derivations of the previous sequence are applied again
+// where their words still match the frame, so that the crunch
+// only continues on the changed regions
+
+#define WARM_KEY   4   // word bytes hashed in the index
+#define WARM_CHAIN 32  // maximum words compared per position
+
+#define WARM_INDEX_BITS 16
+#define WARM_INDEX_SIZE (1 << WARM_INDEX_BITS)
+
+uint_t warm_count;
+uint_t warm_size;
+
+static uint_t sym_first [SYMBOL_MAX];  // sequence index of first occurrence
+static uint_t sym_next [SYMBOL_MAX];   // next symbol in index chain
+
+static uint_t warm_index [WARM_INDEX_SIZE];
+
+
+static uint_t warm_hash (const uchar_t * word)
+	{
+	uint_t key = word [0] | (word [1] << 8) | (word [2] << 16) | ((uint_t) word [3] << 24);
+	return (key * 2654435761u) >> (32 - WARM_INDEX_BITS);
+	}
+
+
+// Derive the symbol tree of a previous symbol over the base symbols
+// at a position of the sequence
+
+static symbol_t * warm_tree (uint_t id, uint_t pos)
+	{
+	if (sym_id [id]) return sym_id [id];
+
+	grammar_sym_t * gs = syms + id;
+	if (gs->left == GRAMMAR_BASE) return pos_sym [pos];
+
+	symbol_t * left = warm_tree (gs->left, pos);
+	symbol_t * right = warm_tree (gs->right, pos + sym_size [gs->left]);
+
+	sym_id [id] = sym_derive (left, right, pos);
+	return sym_id [id];
+	}
+
+
+// Get the sequence index of the longest previous word at a position
+
+static uint_t warm_find (uint_t pos)
+	{
+	uint_t best = GRAMMAR_NONE;
+	uint_t best_size = 0;
+
+	uint_t id = warm_index [warm_hash (frame_in + pos)];
+	for (uint_t c = 0; c < WARM_CHAIN && id != GRAMMAR_NONE; c++)
+		{
+		uint_t size = sym_size [id];
+
+		if (size > best_size && pos + size <= size_in
+			&& !memcmp (frame_in + pos, gram_frame + sym_off [id], size))
+			{
+			best = sym_first [id];
+			best_size = size;
+			}
+
+		id = sym_next [id];
+		}
+
+	return best;
+	}
+
+
+// Returns 0 when the file is missing or not valid
+// The frame must be just scanned for its base symbols
+
+uchar grammar_warm (const char * name)
+	{
+	warm_count = 0;
+	warm_size = 0;
+
+	grammar_head_t head;
+	if (!grammar_read (name, &head) || !grammar_frame (&head)) return 0;
+
+	// Index the words long enough to be hashed
+	// at their first occurrence
+
+	for (uint_t i = 0; i < WARM_INDEX_SIZE; i++)
+		warm_index [i] = GRAMMAR_NONE;
+
+	for (uint_t k = 0; k < head.pos_count; k++)
+		{
+		uint_t id = seq [k];
+		uint_t off = seq_off [k];
+
+		if (sym_off [id] == off && sym_size [id] >= WARM_KEY)
+			{
+			uint_t * slot = warm_index + warm_hash (gram_frame + off);
+
+			sym_first [id] = k;
+			sym_next [id] = *slot;
+			*slot = id;
+			}
+		}
+
+	// Match the previous words along the frame
+	// The word following the last match is tried first
+
+	uint_t pos = 0;
+	uint_t next = 0;
+
+	while (pos < size_in)
+		{
+		uint_t k = GRAMMAR_NONE;
+
+		if (next < head.pos_count)
+			{
+			uint_t size = sym_size [seq [next]];
+
+			if (pos + size <= size_in
+				&& !memcmp (frame_in + pos, gram_frame + seq_off [next], size))
+				k = next;
+			}
+
+		if (k == GRAMMAR_NONE && pos + WARM_KEY <= size_in)
+			k = warm_find (pos);
+
+		if (k == GRAMMAR_NONE)
+			{
+			pos++;
+			continue;
+			}
+
+		uint_t id = seq [k];
+		uint_t size = sym_size [id];
+
+		if (size > 1)
+			{
+			word_add (warm_tree (id, pos), pos);
+
+			warm_count++;
+			warm_size += size;
+			}
+
+		pos += size;
+		next = k + 1;
+		}
+
+	if (warm_count) word_holes ();
+	return 1;
+	}
+
+
+//------------------------------------------------------------------------------
@@ -0,0 +1,25 @@
+//------------------------------------------------------------------------------
+// Grammar cache
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include "common.h"
+
+
+// Save the symbol tree and the sequence after the word crunch
+// Load them back for the same frame and crunch settings,
+// and only after a warm start when saved after one
+
+void grammar_save (const char * name, uchar warm);
+uchar grammar_load (const char * name, uchar warm);
+
+// Apply the grammar of a previous frame where it still matches
+
+extern uint_t warm_count;  // words reused
+extern uint_t warm_size;   // bytes covered by the reused words
+
+uchar grammar_warm (const char * name);
+
+
+//------------------------------------------------------------------------------
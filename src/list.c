@@ -2,6 +2,7 @@
 // Double-linked list
 //------------------------------------------------------------------------------
 
+#include "common.h"
 #include "list.h"
 
 
@@ -53,4 +54,86 @@ void list_remove (list_t * node)
 	}
 
 
+// Merge two sorted lists linked by next only
+// The first one wins on equal nodes to keep the sort stable
+
+static list_t * list_merge (list_t * first, list_t * second, list_comp_t comp)
+	{
+	list_t head;
+	list_t * tail = &head;
+
+	while (first && second)
+		{
+		if (comp (second, first) < 0)
+			{
+			tail->next = second;
+			second = second->next;
+			}
+		else
+			{
+			tail->next = first;
+			first = first->next;
+			}
+
+		tail = tail->next;
+		}
+
+	tail->next = first ? first : second;
+	return head.next;
+	}
+
+
+// Stable bottom-up merge sort
+
+#define PART_MAX 32
+
+void list_sort (list_t * root, list_comp_t comp)
+	{
+	if (root->next == root) return;
+
+	list_t * part [PART_MAX];
+	for (uint i = 0; i < PART_MAX; i++) part [i] = NULL;
+
+	// Break the ring and merge nodes by power of 2 runs
+	// Older nodes go to the upper parts
+
+	root->prev->next = NULL;
+	list_t * node = root->next;
+
+	while (node)
+		{
+		list_t * next = node->next;
+		node->next = NULL;
+
+		uint i = 0;
+		while (i < PART_MAX - 1 && part [i])
+			{
+			node = list_merge (part [i], node, comp);
+			part [i++] = NULL;
+			}
+
+		part [i] = list_merge (part [i], node, comp);
+		node = next;
+		}
+
+	node = NULL;
+	for (uint i = 0; i < PART_MAX; i++)
+		node = list_merge (part [i], node, comp);
+
+	// Rebuild the ring with the previous links
+
+	list_t * prev = root;
+	while (node)
+		{
+		prev->next = node;
+		node->prev = prev;
+		prev = node;
+		node = node->next;
+		}
+
+	prev->next = root;
+	root->prev = prev;
+	}
+
+
 //------------------------------------------------------------------------------
@@ -13,6 +13,8 @@ struct list_s
 
 typedef struct list_s list_t;
 
+typedef int (* list_comp_t) (list_t * node1, list_t * node2);
+
 
 void list_init (list_t * root);
 
@@ -24,5 +26,7 @@ void list_add_head (list_t * root, list_t * node);
 
 void list_remove (list_t * node);
 
+void list_sort (list_t * root, list_comp_t comp);
+
 
 //------------------------------------------------------------------------------
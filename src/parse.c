@@ -0,0 +1,282 @@
+//------------------------------------------------------------------------------
+// Optimal parse
+//------------------------------------------------------------------------------
+
+#include <stdlib.h>
+#include <string.h>
+#include <error.h>
+#include <limits.h>
+
+#include "common.h"
+#include "list.h"
+#include "stream.h"
+#include "symbol.h"
+#include "parse.h"
+
+
+// The crunch builds the sequence greedily, and the symbols dropped
+// by the selection are output through their children
+// The parse finds the cheapest sequence of base codes, kept symbols
+// and repeats over the frame, from the end to the start
+
+// Global data
+
+parse_tok_t parse_toks [FRAME_MAX];
+uint_t parse_count;
+
+
+// Best token at each frame offset
+
+static uint_t dp_cost [FRAME_MAX + 1];  // cost from the offset to the end
+static uint_t dp_size [FRAME_MAX];      // frame bytes covered by the token
+static uint_t dp_rep [FRAME_MAX];
+static symbol_t * dp_sym [FRAME_MAX];
+
+
+// Window hashes from prefix hashes
+// The multiplier is odd, so it has an inverse modulo 2^64
+
+#define HASH_MUL 0x100000001B3ULL
+
+static ulong_t pre_hash [FRAME_MAX + 1];
+static ulong_t inv_pow [FRAME_MAX + 1];
+
+static void hash_init ()
+	{
+	ulong_t inv = HASH_MUL;
+	for (uint_t i = 0; i < 5; i++)
+		inv *= 2 - HASH_MUL * inv;
+
+	ulong_t pow = 1;
+
+	pre_hash [0] = 0;
+	inv_pow [0] = 1;
+
+	for (uint_t i = 0; i < size_in; i++)
+		{
+		pre_hash [i + 1] = pre_hash [i] + frame_in [i] * pow;
+		inv_pow [i + 1] = inv_pow [i] * inv;
+		pow *= HASH_MUL;
+		}
+	}
+
+static ulong_t hash_window (uint_t pos, uint_t size)
+	{
+	return (pre_hash [pos + size] - pre_hash [pos]) * inv_pow [pos];
+	}
+
+
+// Kept words of several codes, listed by their first two codes
+// The kept base symbols are indexed by their code
+
+#define WORD_NONE ((uint_t) -1)
+
+static uint_t word_head [CODE_MAX * CODE_MAX];
+static uint_t word_next [SYMBOL_MAX];
+static ulong_t word_hash [SYMBOL_MAX];
+static symbol_t * word_sym [SYMBOL_MAX];
+
+static symbol_t * base_sym [CODE_MAX];
+
+static void word_index ()
+	{
+	for (uint_t k = 0; k < CODE_MAX * CODE_MAX; k++)
+		word_head [k] = WORD_NONE;
+
+	memset (base_sym, 0, sizeof (base_sym));
+
+	uint_t count = 0;
+
+	list_t * node = sym_root.next;
+	while (node != &sym_root)
+		{
+		symbol_t * sym = structof (symbol_t, node, node);
+		node = node->next;
+
+		if (!sym->keep || sym->repeat) continue;
+
+		// The symbol expands as the frame at its first occurrence
+
+		if (sym->size == 1)
+			{
+			base_sym [sym->code] = sym;
+			continue;
+			}
+
+		uint_t key = (frame_in [sym->base] << 8) | frame_in [sym->base + 1];
+
+		word_sym [count] = sym;
+		word_hash [count] = hash_window (sym->base, sym->size);
+		word_next [count] = word_head [key];
+		word_head [key] = count;
+		count++;
+		}
+	}
+
+
+// Kept words matched at each frame offset
+// with the count of their repeats from that offset
+
+struct match_s
+	{
+	symbol_t * sym;
+	uint_t run;
+	uint_t next;
+	};
+
+typedef struct match_s match_t;
+
+static match_t * matches;
+static uint_t match_count;
+static uint_t match_max;
+
+static uint_t match_head [FRAME_MAX + 1];
+
+static uint_t match_add (uint_t pos, symbol_t * sym)
+	{
+	// Repeated when matched again just after
+
+	uint_t run = 1;
+
+	uint_t next = pos + sym->size;
+	for (uint_t m = match_head [next]; m != WORD_NONE; m = matches [m].next)
+		{
+		if (matches [m].sym == sym)
+			{
+			run += matches [m].run;
+			break;
+			}
+		}
+
+	if (match_count >= match_max)
+		{
+		match_max = match_max ? 2 * match_max : FRAME_MAX;
+		matches = realloc (matches, match_max * sizeof (match_t));
+		if (!matches) error (1, 0, "no memory for matches");
+		}
+
+	match_t * match = matches + match_count;
+
+	match->sym = sym;
+	match->run = run;
+	match->next = match_head [pos];
+	match_head [pos] = match_count++;
+
+	return run;
+	}
+
+
+// Try a token at a frame offset
+
+static void dp_try (uint_t pos, uint_t size, uint_t rep, symbol_t * sym, uint_t bits)
+	{
+	uint_t cost = dp_cost [pos + size] + bits;
+	if (cost >= dp_cost [pos]) return;
+
+	dp_cost [pos] = cost;
+	dp_size [pos] = size;
+	dp_rep [pos] = rep;
+	dp_sym [pos] = sym;
+	}
+
+
+// Try the repeats of a token
+// Beyond the first counts, only the largest count of each code length,
+// as the count code grows by steps of powers of two
+
+#define REP_TRY 16
+
+static void dp_try_rep (uint_t pos, uint_t size, uint_t run, symbol_t * sym,
+	const parse_cost_t * cost)
+	{
+	uint_t inner = sym ? cost->rep_sym : cost->rep_base;
+
+	for (uint_t rep = 2; rep <= run; )
+		{
+		dp_try (pos, rep * size, rep, sym, cost->rep + cost_pref_odd (rep - 2) + inner);
+
+		if (rep < REP_TRY)
+			rep++;
+		else if (rep < run)
+			rep = (2 * rep < run) ? 2 * rep : run;
+		else
+			break;
+		}
+	}
+
+
+uint parse_frame (const parse_cost_t * cost)
+	{
+	hash_init ();
+	word_index ();
+
+	match_count = 0;
+	match_head [size_in] = WORD_NONE;
+
+	dp_cost [size_in] = 0;
+
+	uint_t run_base = 0;
+
+	for (uint_t pos = size_in; pos-- > 0; )
+		{
+		match_head [pos] = WORD_NONE;
+		dp_cost [pos] = UINT_MAX;
+
+		// Base code, repeated or not
+
+		uchar_t code = frame_in [pos];
+
+		run_base = (pos + 1 < size_in && frame_in [pos + 1] == code) ? run_base + 1 : 1;
+
+		dp_try (pos, 1, 1, NULL, cost->base);
+		if (cost->rep) dp_try_rep (pos, 1, run_base, NULL, cost);
+
+		// Kept symbols
+
+		symbol_t * sym = base_sym [code];
+		if (sym)
+			{
+			dp_try (pos, 1, 1, sym, cost->sym);
+			if (cost->rep) dp_try_rep (pos, 1, run_base, sym, cost);
+			}
+
+		if (pos + 1 >= size_in) continue;
+
+		uint_t key = (code << 8) | frame_in [pos + 1];
+
+		for (uint_t w = word_head [key]; w != WORD_NONE; w = word_next [w])
+			{
+			sym = word_sym [w];
+			uint_t size = sym->size;
+
+			if (pos + size > size_in || hash_window (pos, size) != word_hash [w]) continue;
+			if (memcmp (frame_in + pos, frame_in + sym->base, size)) continue;
+
+			dp_try (pos, size, 1, sym, cost->sym);
+
+			if (cost->rep)
+				{
+				uint_t run = match_add (pos, sym);
+				dp_try_rep (pos, size, run, sym, cost);
+				}
+			}
+		}
+
+	// Follow the best tokens from the start
+
+	parse_count = 0;
+
+	for (uint_t pos = 0; pos < size_in; pos += dp_size [pos])
+		{
+		parse_tok_t * tok = parse_toks + parse_count++;
+
+		tok->pos = pos;
+		tok->rep = dp_rep [pos];
+		tok->sym = dp_sym [pos];
+		}
+
+	return dp_cost [0];
+	}
+
+
+//------------------------------------------------------------------------------
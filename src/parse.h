@@ -0,0 +1,49 @@
+//------------------------------------------------------------------------------
+// Optimal parse
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include "common.h"
+#include "symbol.h"
+
+
+// Token costs in bits
+
+struct parse_cost_s
+	{
+	uint base;      // base code
+	uint sym;       // kept symbol reference
+
+	uint rep;       // repeat flags (0 = no repeat)
+	uint rep_base;  // repeated base code
+	uint rep_sym;   // repeated kept symbol reference
+	};
+
+typedef struct parse_cost_s parse_cost_t;
+
+
+// Frame token
+// A base code or a kept symbol, repeated or not
+
+struct parse_tok_s
+	{
+	uint_t pos;  // frame offset
+	uint_t rep;  // repeat count (1 = no repeat)
+
+	symbol_t * sym;  // kept symbol or none for a base code
+	};
+
+typedef struct parse_tok_s parse_tok_t;
+
+extern parse_tok_t parse_toks [FRAME_MAX];
+extern uint_t parse_count;
+
+
+// Parse the frame with the kept symbols at the lowest cost
+// Returns the frame cost in bits
+
+uint parse_frame (const parse_cost_t * cost);
+
+
+//------------------------------------------------------------------------------
@@ -0,0 +1,86 @@
+//------------------------------------------------------------------------------
+// Object pool
+//------------------------------------------------------------------------------
+
+#include <stdlib.h>
+#include <error.h>
+
+#include "pool.h"
+
+
+#define BLOCK_COUNT 1024  // objects per block
+
+#define BLOCK_DATA(block) ((char *) (block) + sizeof (block_t))
+
+
+void pool_init (pool_t * pool, uint_t size)
+	{
+	// Keep objects aligned for any member
+	size = (size + sizeof (void *) - 1) & ~(sizeof (void *) - 1);
+
+	pool->size = size;
+	pool->used = 0;
+
+	pool->first = NULL;
+	pool->block = NULL;
+
+	pool->free = NULL;
+	}
+
+
+void * pool_alloc (pool_t * pool)
+	{
+	// Reuse a freed object first
+
+	void * obj = pool->free;
+	if (obj)
+		{
+		pool->free = * (void **) obj;
+		return obj;
+		}
+
+	// Then the current block or the next one
+	// Blocks are kept over a reset
+
+	if (!pool->block || pool->used == BLOCK_COUNT)
+		{
+		block_t * block = pool->block ? pool->block->next : pool->first;
+		if (!block)
+			{
+			block = malloc (sizeof (block_t) + pool->size * BLOCK_COUNT);
+			if (!block) error (1, 0, "out of memory");
+
+			block->next = NULL;
+
+			if (pool->block)
+				pool->block->next = block;
+			else
+				pool->first = block;
+			}
+
+		pool->block = block;
+		pool->used = 0;
+		}
+
+	return BLOCK_DATA (pool->block) + pool->size * pool->used++;
+	}
+
+
+void pool_free (pool_t * pool, void * obj)
+	{
+	* (void **) obj = pool->free;
+	pool->free = obj;
+	}
+
+
+// Release all objects at once
+
+void pool_reset (pool_t * pool)
+	{
+	pool->block = NULL;
+	pool->used = 0;
+	pool->free = NULL;
+	}
+
+
+//------------------------------------------------------------------------------
@@ -0,0 +1,42 @@
+//------------------------------------------------------------------------------
+// Object pool
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include "common.h"
+
+
+// Objects of the same size are allocated by blocks
+// and released all at once by a reset
+
+struct block_s
+	{
+	struct block_s * next;
+	};
+
+typedef struct block_s block_t;
+
+struct pool_s
+	{
+	uint_t size;      // object size
+	uint_t used;      // objects used in current block
+
+	block_t * first;  // list of blocks
+	block_t * block;  // current block
+
+	void * free;      // list of freed objects
+	};
+
+typedef struct pool_s pool_t;
+
+
+void pool_init (pool_t * pool, uint_t size);
+
+void * pool_alloc (pool_t * pool);
+void pool_free (pool_t * pool, void * obj);
+
+void pool_reset (pool_t * pool);
+
+
+//------------------------------------------------------------------------------
@@ -10,8 +10,8 @@
 
 // Global data
 
-uchar_t frame_in [FRAME_MAX];
-uchar_t frame_out [FRAME_MAX];
+uchar_t frame_in [FRAME_IN_MAX];
+uchar_t frame_out [FRAME_OUT_MAX];
 
 uint_t size_in;
 uint_t size_out;
@@ -35,7 +35,7 @@ void in_frame (const char * name)
 	FILE * file = fopen (name, "r");
 	if (!file) error (1, errno, "open failed");
 
-	size_t size = fread (frame_in, sizeof (uchar_t), FRAME_MAX, file);
+	size_t size = fread (frame_in, sizeof (uchar_t), FRAME_IN_MAX, file);
 	if (ferror (file)) error (1, errno, "load failed");
 
 	size_in = size;
@@ -55,11 +55,28 @@ void out_frame (const char * name)
 	}
 
 
+// Frame hash (FNV-1a)
+// Identifies the content of a frame in the caches
+
+ulong_t hash_frame (uchar_t * frame, uint_t size)
+	{
+	ulong_t hash = 0xCBF29CE484222325ULL;
+
+	for (uint_t i = 0; i < size; i++)
+		{
+		hash ^= frame [i];
+		hash *= 0x100000001B3ULL;
+		}
+
+	return hash;
+	}
+
+
 // Byte code
 
 void out_byte (uchar_t val)
 	{
-	if (size_out >= FRAME_MAX)
+	if (size_out >= FRAME_OUT_MAX)
 		{
 		puts ("HELP!");
 		error (1, 0, "out overflow");
@@ -69,17 +86,20 @@ void out_byte (uchar_t val)
 	}
 
 
+// End of the bit stream
+// The last byte is padded with zeros, and no code is
+// shorter than 8 bits with only zeros, so the remaining
+// bits are still codes while any of them is set
+
 uchar in_eof ()
 	{
-	// FIXME: unsafe function
-	// puts ("I'M BUGGY - REMOVE ME !!!");
-	return (pos_in == size_in);
+	return (pos_in == size_in) && !byte_in;
 	}
 
 
 uchar_t in_byte ()
 	{
-	if (pos_in >= FRAME_MAX)
+	if (pos_in >= FRAME_IN_MAX)
 		error (1, 0, "in overflow");
 
 	return frame_in [pos_in++];
@@ -130,7 +150,7 @@ void out_pad ()
 		{
 		byte_out >>= (7 - shift_out);
 
-		if (size_out >= FRAME_MAX)
+		if (size_out >= FRAME_OUT_MAX)
 			error (1, 0, "out overflow");
 
 		frame_out [size_out++] = byte_out;
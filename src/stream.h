@@ -12,11 +12,21 @@
 #define CODE_MAX 256  // 8 bits
 #define FRAME_MAX 65536  // 64K
 
+// Compressed frame starts with the algorithm tag
+// and is never longer than the stored frame
+
+#define FRAME_HEAD 1
+#define FRAME_IN_MAX (FRAME_MAX + FRAME_HEAD)
+
+// Room for an expanding compression before the fallback
+
+#define FRAME_OUT_MAX (2 * FRAME_MAX)
+
 
 // Global data
 
-extern uchar_t frame_in [FRAME_MAX];
-extern uchar_t frame_out [FRAME_MAX];
+extern uchar_t frame_in [FRAME_IN_MAX];
+extern uchar_t frame_out [FRAME_OUT_MAX];
 
 extern uint_t size_in;
 extern uint_t size_out;
@@ -27,6 +37,8 @@ extern uint_t size_out;
 void in_frame (const char * name);
 void out_frame (const char * name);
 
+ulong_t hash_frame (uchar_t * frame, uint_t size);
+
 void out_byte (uchar_t val);
 uchar in_eof ();
 uchar_t in_byte ();
@@ -0,0 +1,118 @@
+//------------------------------------------------------------------------------
+// Suffix array
+//------------------------------------------------------------------------------
+
+#include <string.h>
+
+#include "common.h"
+#include "stream.h"
+#include "suffix.h"
+
+
+static uint_t rank [FRAME_MAX];
+static uint_t temp [FRAME_MAX];
+static uint_t hist [FRAME_MAX + 1];
+
+
+// Stable counting sort of suffixes by rank
+
+static void sort_rank (uint_t * from, uint_t * to, uint_t count, uint_t rank_max)
+	{
+	memset (hist, 0, (rank_max + 1) * sizeof (uint_t));
+
+	for (uint_t i = 0; i < count; i++)
+		hist [rank [from [i]]]++;
+
+	uint_t sum = 0;
+	for (uint_t r = 0; r <= rank_max; r++)
+		{
+		uint_t n = hist [r];
+		hist [r] = sum;
+		sum += n;
+		}
+
+	for (uint_t i = 0; i < count; i++)
+		to [hist [rank [from [i]]]++] = from [i];
+	}
+
+
+// Prefix doubling: suffixes sorted by the first 2k codes
+// from the order by the first k codes
+
+void suffix_sort (uchar_t * text, uint_t count, uint_t * sa, uint_t * lcp)
+	{
+	if (!count) return;
+
+	for (uint_t i = 0; i < count; i++)
+		{
+		temp [i] = i;
+		rank [i] = text [i];
+		}
+
+	sort_rank (temp, sa, count, CODE_MAX - 1);
+
+	uint_t rank_max = CODE_MAX - 1;
+
+	for (uint_t k = 1; ; k <<= 1)
+		{
+		// Order by the second half: the short suffixes first
+
+		uint_t n = 0;
+		for (uint_t i = count - k < count ? count - k : 0; i < count; i++)
+			temp [n++] = i;
+
+		for (uint_t i = 0; i < count; i++)
+			{
+			if (sa [i] >= k) temp [n++] = sa [i] - k;
+			}
+
+		// Then by the first half
+
+		sort_rank (temp, sa, count, rank_max);
+
+		// Rank again by both halves
+
+		temp [sa [0]] = 0;
+		uint_t r = 0;
+
+		for (uint_t i = 1; i < count; i++)
+			{
+			uint_t s1 = sa [i - 1];
+			uint_t s2 = sa [i];
+
+			uint_t next1 = (s1 + k < count) ? rank [s1 + k] + 1 : 0;
+			uint_t next2 = (s2 + k < count) ? rank [s2 + k] + 1 : 0;
+
+			if (rank [s1] != rank [s2] || next1 != next2) r++;
+			temp [s2] = r;
+			}
+
+		memcpy (rank, temp, count * sizeof (uint_t));
+		rank_max = r;
+
+		if (r == count - 1 || k >= count) break;
+		}
+
+	// Longest common prefixes in text order (Kasai)
+
+	uint_t h = 0;
+	for (uint_t i = 0; i < count; i++)
+		{
+		uint_t r = rank [i];
+		if (!r)
+			{
+			lcp [0] = 0;
+			h = 0;
+			continue;
+			}
+
+		uint_t j = sa [r - 1];
+		while (i + h < count && j + h < count && text [i + h] == text [j + h]) h++;
+
+		lcp [r] = h;
+		if (h) h--;
+		}
+	}
+
+
+//------------------------------------------------------------------------------
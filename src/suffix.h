@@ -0,0 +1,16 @@
+//------------------------------------------------------------------------------
+// Suffix array
+//------------------------------------------------------------------------------
+
+#pragma once
+
+#include "common.h"
+
+
+// Sort the suffixes of a text (at most FRAME_MAX codes)
+// and compute the longest common prefix of each with the previous one
+
+void suffix_sort (uchar_t * text, uint_t count, uint_t * sa, uint_t * lcp);
+
+
+//------------------------------------------------------------------------------
@@ -7,10 +7,18 @@
 #include <error.h>
 #include <math.h>
 #include <limits.h>
+#include <pthread.h>
+#include <time.h>
+
+#if defined (__AVX2__) || defined (__SSE2__)
+#include <immintrin.h>
+#endif
 
 #include "common.h"
 #include "list.h"
+#include "pool.h"
 #include "stream.h"
+#include "suffix.h"
 #include "symbol.h"
 
 
@@ -19,31 +27,80 @@
 list_t sym_root;
 uint_t sym_count;
 
-list_t pos_root;
+symbol_t * pos_sym [FRAME_MAX];
+uint_t pos_next [FRAME_MAX];
+uint_t pos_prev [FRAME_MAX];
+
+uint_t pos_head;
 uint_t pos_count;
 
 index_sym_t index_sym [SYMBOL_MAX];
 uint_t index_count;
 
-uint keep_count;
 uchar ref_bit;
 
+table_t sym_table;
+
+uint_t thread_count = 1;  // worker threads
+
+uint_t seed_len;  // minimum seeded word length (0 = no seeding)
+uint_t seed_count;
+uint_t seed_size;
+
+uint_t crunch_batch = 1;  // maximum pairs crunched per round
+uint_t crunch_min = 2;    // minimum count of a crunched pair
+uint_t crunch_budget;     // milliseconds to stop crunching (0 = none)
+
+uint_t crunch_round;
+uint_t crunch_count;
+uint_t crunch_left;       // count of the top pair left when stopped
+
+uint_t crunch_tie;  // tie-break policy
+
 
 // Local data
 
-static list_t pair_root;
-static list_t hole_root;
+static pool_t sym_pool;
+static pool_t pair_pool;
 
+static pair_t * pos_pair [FRAME_MAX];  // pair starting at position
 
-// Symbol helpers
+static uint_t occ_next [FRAME_MAX];  // next occurrence of the same pair
+static uint_t occ_prev [FRAME_MAX];  // previous occurrence of the same pair
 
-static int sym_comp (const void * v1, const void * v2)
-	{
-	int k1 = ((index_sym_t *) v1)->key;
-	int k2 = ((index_sym_t *) v2)->key;
+static uint_t hole_pos [FRAME_MAX];  // positions without pair in order
+static uint_t hole_count;
 
-	return (k1 < k2) ? 1 : ((k1 > k2) ? -1 : 0);
-	}
+static uchar pair_base;  // sequence of base symbols not yet paired
+
+static ushort_t pair_key [FRAME_MAX];
+static ushort_t pair_hist [2 * THREAD_MAX][CODE_MAX * CODE_MAX];
+static pair_t * pair_direct [CODE_MAX * CODE_MAX];
+
+
+// Pair index
+// Hash table keyed on the (left, right) symbol pair
+
+#define PAIR_INDEX_BITS 16
+#define PAIR_INDEX_SIZE (1 << PAIR_INDEX_BITS)
+
+static pair_t * pair_index [PAIR_INDEX_SIZE];
+
+
+// Pair buckets
+// Priority queue of the asymmetric pairs by occurrence count
+// An asymmetric pair cannot overlap itself, so its count is at most half the frame
+
+#define BUCKET_MAX (FRAME_MAX / 2 + 1)
+
+static list_t bucket_root [BUCKET_MAX];
+static uchar bucket_sort [BUCKET_MAX];  // bucket to sort before selection
+static uint_t bucket_top;
+
+static uint_t pair_order;
+
+
+// Symbol helpers
 
 
 symbol_t * sym_add ()
@@ -51,18 +108,211 @@ symbol_t * sym_add ()
 	if (sym_count >= SYMBOL_MAX)
 		error (1, 0, "too many symbols");
 
-	symbol_t * sym = malloc (sizeof (symbol_t));
+	symbol_t * sym = pool_alloc (&sym_pool);
 	memset (sym, 0, sizeof (symbol_t));
 
+	sym->id = sym_count;
+
 	list_add_tail (&sym_root, &sym->node);
 	sym_count++;
 	return sym;
 	}
 
-// Build index and sort
+// Derived symbol index
+// Identical derivations and repeats share one symbol
+
+#define SYM_INDEX_BITS 16
+#define SYM_INDEX_SIZE (1 << SYM_INDEX_BITS)
+
+static symbol_t * sym_index [SYM_INDEX_SIZE];
+
+static uint_t sym_hash (symbol_t * left, symbol_t * right)
+	{
+	// Symbol identifiers are below 64K so the key is unique
+	uint_t key = (left->id << 16) | right->id;
+	return (key * 2654435761u) >> (32 - SYM_INDEX_BITS);
+	}
+
+
+// Get the symbol derived from two children
+// Created on first derivation
+
+symbol_t * sym_derive (symbol_t * left, symbol_t * right, uint_t base)
+	{
+	symbol_t ** slot = sym_index + sym_hash (left, right);
+
+	symbol_t * sym = *slot;
+	while (sym)
+		{
+		if (!sym->repeat && sym->left == left && sym->right == right) return sym;
+		sym = sym->hash_next;
+		}
+
+	sym = sym_add ();
+
+	sym->base = base;
+	sym->size = left->size + right->size;
+
+	sym->left = left;
+	left->sym_count++;
+
+	sym->right = right;
+	right->sym_count++;
+
+	sym->hash_next = *slot;
+	*slot = sym;
+
+	return sym;
+	}
+
+
+// Get the symbol repeating a child a number of times
+// Created on first repeat
+
+static uint_t rep_hash (symbol_t * child, uint_t count)
+	{
+	uint_t key = (child->id << 16) ^ count;
+	return (key * 2654435761u) >> (32 - SYM_INDEX_BITS);
+	}
+
+symbol_t * sym_repeat (symbol_t * child, uint_t count)
+	{
+	symbol_t ** slot = sym_index + rep_hash (child, count);
+
+	symbol_t * sym = *slot;
+	while (sym)
+		{
+		if (sym->repeat && sym->left == child && sym->rep_count == count) return sym;
+		sym = sym->hash_next;
+		}
+
+	sym = sym_add ();
+	sym->repeat = 1;
+
+	sym->rep_count = count;
+
+	sym->code = child->code;
+	sym->base = child->base;
+	sym->size = child->size;
+
+	sym->left = child;
+
+	sym->hash_next = *slot;
+	*slot = sym;
+
+	return sym;
+	}
+
+
+// Release all symbols for a new job
+
+void sym_reset ()
+	{
+	if (!sym_pool.size)
+		{
+		pool_init (&sym_pool, sizeof (symbol_t));
+		pool_init (&pair_pool, sizeof (pair_t));
+		}
+
+	pool_reset (&sym_pool);
+	memset (sym_index, 0, sizeof (sym_index));
+
+	list_init (&sym_root);
+	sym_count = 0;
+	}
+
+
+// Stable radix sort of the symbol index by decreasing key
+// Keys are mapped to unsigned in reverse order, one byte per pass
+
+static index_sym_t index_temp [SYMBOL_MAX];
+
+static void sort_radix (uint_t count)
+	{
+	index_sym_t * from = index_sym;
+	index_sym_t * to = index_temp;
+
+	for (uint_t shift = 0; shift < 32; shift += 8)
+		{
+		uint_t hist [256];
+		memset (hist, 0, sizeof (hist));
+
+		for (uint_t i = 0; i < count; i++)
+			hist [(SORT_RANK (from [i].key) >> shift) & 0xFF]++;
+
+		// Skip the pass when all the keys share the byte
+
+		if (hist [(SORT_RANK (from [0].key) >> shift) & 0xFF] == count)
+			continue;
+
+		uint_t sum = 0;
+		for (uint_t b = 0; b < 256; b++)
+			{
+			uint_t n = hist [b];
+			hist [b] = sum;
+			sum += n;
+			}
+
+		for (uint_t i = 0; i < count; i++)
+			to [hist [(SORT_RANK (from [i].key) >> shift) & 0xFF]++] = from [i];
+
+		index_sym_t * swap = from;
+		from = to;
+		to = swap;
+		}
+
+	if (from != index_sym)
+		memcpy (index_sym, from, count * sizeof (index_sym_t));
+	}
+
+
+// Stable selection of the top keys in front of the symbol index
+// The other symbols follow in list order
+
+static void sort_top (uint_t count, uint_t top)
+	{
+	uint_t top_count = 0;
+
+	for (uint_t i = 0; i < count; i++)
+		{
+		// Equal keys stay after the previous ones
+
+		int key = index_sym [i].key;
+		if (top_count == top && index_temp [top - 1].key >= key) continue;
+
+		uint_t j = (top_count < top) ? top_count++ : top - 1;
+		while (j > 0 && index_temp [j - 1].key < key)
+			{
+			index_temp [j] = index_temp [j - 1];
+			j--;
+			}
+
+		index_temp [j] = index_sym [i];
+		}
+
+	// Compact the others after the selected ones
+	// The symbol indexes are cleared by the caller and used as selection flags
+
+	for (uint_t i = 0; i < top_count; i++)
+		index_temp [i].sym->index = 1;  // selected
+
+	uint_t rest = top_count;
+	for (uint_t i = 0; i < count; i++)
+		{
+		if (!index_sym [i].sym->index)
+			index_temp [rest++] = index_sym [i];
+		}
+
+	memcpy (index_sym, index_temp, count * sizeof (index_sym_t));
+	}
+
+
+// Build index and sort by decreasing key
+// Only the top symbols are ordered, in front of the index
+// Ties are kept in list order
 // TODO: build key in callback
 
-void sym_sort (uint_t kind)
+void sym_top (uint_t kind, uint_t top)
 	{
 	list_t * node = sym_root.next;
 	index_sym_t * index = index_sym;
@@ -113,12 +363,19 @@ void sym_sort (uint_t kind)
 			}
 
 		index->sym = sym;
+		sym->index = 0;
 
 		node = node->next;
 		index++;
 		}
 
-	qsort (index_sym, sym_count, sizeof (index_sym_t), sym_comp);
+	if (sym_count)
+		{
+		if (top < SORT_TOP_MAX && top < sym_count)
+			sort_top (sym_count, top);
+		else
+			sort_radix (sym_count);
+		}
 
 	// Set symbol indexes
 
@@ -131,6 +388,12 @@ void sym_sort (uint_t kind)
 	}
 
 
+void sym_sort (uint_t kind)
+	{
+	sym_top (kind, sym_count);
+	}
+
+
 // List the used symbols
 
 void sym_list (uint_t filter)
@@ -186,18 +449,57 @@ void sym_list (uint_t filter)
 
 // Add a position to the hole list
 
-static void hole_add (position_t * pos)
+static void hole_add (uint_t pos)
+	{
+	hole_pos [hole_count++] = pos;
+	}
+
+
+// Remove a position from the sequence
+// The position is left as a tombstone
+
+static void pos_remove (uint_t pos)
 	{
-	list_add_tail (&hole_root, &pos->node_hole);
+	uint_t prev = pos_prev [pos];
+	uint_t next = pos_next [pos];
+
+	if (prev != POS_NONE)
+		pos_next [prev] = next;
+	else
+		pos_head = next;
+
+	if (next != POS_NONE) pos_prev [next] = prev;
+
+	pos_sym [pos] = NULL;
+	pos_count--;
 	}
 
-// Remove a position from the hole list
 
-static void hole_remove (position_t * pos)
+// Count byte codes in a single pass
+// Interleaved counters break the dependency between increments
+// of the same code, as in the long runs of data sections
+
+#define HIST_WAYS 4
+
+static void count_base (uint_t * count)
 	{
-	list_remove (&pos->node_hole);
-	// Zero the node_hole to detect bad pointers
-	memset (&pos->node_hole, 0, sizeof (list_t));
+	uint_t part [HIST_WAYS][CODE_MAX];
+	memset (part, 0, sizeof (part));
+
+	uint_t i = 0;
+	for (; i + HIST_WAYS <= size_in; i += HIST_WAYS)
+		{
+		part [0][frame_in [i]]++;
+		part [1][frame_in [i + 1]]++;
+		part [2][frame_in [i + 2]]++;
+		part [3][frame_in [i + 3]]++;
+		}
+
+	for (; i < size_in; i++)
+		part [0][frame_in [i]]++;
+
+	for (uint_t c = 0; c < CODE_MAX; c++)
+		count [c] = part [0][c] + part [1][c] + part [2][c] + part [3][c];
 	}
 
 
@@ -205,9 +507,9 @@ static void hole_remove (position_t * pos)
 
 void scan_base ()
 	{
-	list_init (&sym_root);
-	list_init (&pos_root);
-	list_init (&hole_root);
+	sym_reset ();
+
+	hole_count = 0;
 
 	// Initialize the symbol index
 
@@ -215,538 +517,1622 @@ void scan_base ()
 
 	// Count symbol occurrences
 
-	for (uint_t i = 0; i < size_in; i++)
-		{
-		index_sym_t * index = index_sym + frame_in [i];
-		symbol_t * sym = index->sym;
+	uint_t count [CODE_MAX];
+	count_base (count);
 
-		if (!sym)
-			{
-			sym = sym_add ();
+	uint_t code_count = 0;
+	for (uint_t c = 0; c < CODE_MAX; c++)
+		if (count [c]) code_count++;
 
-			sym->code = frame_in [i];
-			sym->base = i;
-			sym->size = 1;
+	// Create the base symbols in order of first occurrence
 
-			index->sym = sym;
-			}
+	for (uint_t i = 0; code_count; i++)
+		{
+		index_sym_t * index = index_sym + frame_in [i];
+		if (index->sym) continue;
 
-		position_t * pos = malloc (sizeof (position_t));
-		list_add_tail (&pos_root, &pos->node);
+		symbol_t * sym = sym_add ();
 
-		pos->base = i;
-		pos->sym = sym;
-		pos->pair = NULL;
+		sym->code = frame_in [i];
+		sym->base = i;
+		sym->size = 1;
+		sym->pos_count = count [sym->code];
 
-		// Record hole (= position without pair)
+		index->sym = sym;
+		code_count--;
+		}
 
-		if (i + 1 < size_in) hole_add (pos);
+	// Fill the sequence
 
-		sym->pos_count++;
+	for (uint_t i = 0; i < size_in; i++)
+		{
+		pos_sym [i] = index_sym [frame_in [i]].sym;
+		pos_prev [i] = i - 1;  // POS_NONE for first
+		pos_next [i] = i + 1;
+		pos_pair [i] = NULL;
 		}
 
+	if (size_in) pos_next [size_in - 1] = POS_NONE;
+
+	pos_head = size_in ? 0 : POS_NONE;
 	pos_count = size_in;
+
+	// All positions are holes (= position without pair)
+	// but the first pair scan takes them from the frame
+
+	pair_base = 1;
 	}
 
 
-// Scan frame holes for new pairs
+// Check the frame for random bytes before any crunch
+// Nearly uniform byte codes, and no more repeated pairs
+// than expected from uniform random bytes
 
-static void scan_pair ()
-	{
-	list_t * hole_left = hole_root.next;
-	while (hole_left != &hole_root)
-		{
-		position_t * pos_left = structof (position_t, node_hole, hole_left);
-		position_t * pos_left_next = (position_t *) (pos_left->node.next);  // node as first member
+#define RANDOM_ENTROPY 7.5  // minimum bits per byte
+#define RANDOM_MARGIN  1.25
+#define RANDOM_SLACK   32   // repeated pairs by chance on small frames
 
-		// Replace hole by a new pair
+uchar scan_random ()
+	{
+	if (size_in < 2) return 0;
 
-		pair_t * pair = malloc (sizeof (pair_t));
-		list_add_tail (&pair_root, &pair->node);
+	uint_t count [CODE_MAX];
+	count_base (count);
 
-		pair->count = 1;
+	double entropy = 0.0;
 
-		pair->left = pos_left->sym;
-		pair->right = pos_left_next->sym;
+	for (uint_t c = 0; c < CODE_MAX; c++)
+		{
+		if (!count [c]) continue;
 
-		pos_left->pair = pair;  // pair at position now
+		double p = (double) count [c] / size_in;
+		entropy += -p * log2 (p);
+		}
 
-		// Scan for pair duplicates
+	if (entropy < RANDOM_ENTROPY) return 0;
 
-		list_t * hole_right = hole_left->next;
-		while (hole_right != &hole_root)
-			{
-			list_t * hole_right_next = hole_right->next;
+	// Repeated pairs are all the pairs but the distinct ones
 
-			position_t * pos_right = structof (position_t, node_hole, hole_right);
-			position_t * pos_right_next = (position_t *) (pos_right->node.next);  // node as first member
+	static uchar_t pair_seen [CODE_MAX * CODE_MAX / 8];
+	memset (pair_seen, 0, sizeof (pair_seen));
 
-			if ((pair->left == pos_right->sym) &&
-				(pair->right == pos_right_next->sym))
-				{
-				pair->count++;
+	uint_t pair_count = size_in - 1;
+	uint_t dist_count = 0;
 
-				pos_right->pair = pair;  // pair at position now
-				hole_remove (pos_right);
-				}
+	for (uint_t i = 0; i < pair_count; i++)
+		{
+		uint_t key = (frame_in [i] << 8) | frame_in [i + 1];
+		uchar_t bit = 1 << (key & 7);
 
-			hole_right = hole_right_next;  // TODO: simplify
-			}
+		if (pair_seen [key >> 3] & bit) continue;
 
-		hole_left = hole_left->next;
-		hole_remove (pos_left);
+		pair_seen [key >> 3] |= bit;
+		dist_count++;
 		}
+
+	double keys = CODE_MAX * CODE_MAX;
+	double expect = pair_count - keys * (1.0 - exp (-pair_count / keys));
+
+	return pair_count - dist_count <= expect * RANDOM_MARGIN + RANDOM_SLACK;
 	}
 
 
-static void dec_pair (pair_t * pair)
+// Pair index helpers
+
+static uint_t pair_hash (symbol_t * left, symbol_t * right)
 	{
-	pair->count--;
+	// Symbol identifiers are below 64K so the key is unique
+	uint_t key = (left->id << 16) | right->id;
+	return (key * 2654435761u) >> (32 - PAIR_INDEX_BITS);
+	}
 
-	if (!pair->count)
+static pair_t * pair_find (symbol_t * left, symbol_t * right)
+	{
+	pair_t * pair = pair_index [pair_hash (left, right)];
+
+	while (pair)
 		{
-		list_remove ((list_t *) pair);  // node as first member
-		// Zero the pair to detect bad pointers
-		memset (pair, 0, sizeof (pair_t));
-		free (pair);
+		if (pair->left == left && pair->right == right) break;
+		pair = pair->hash_next;
 		}
-	}
 
+	return pair;
+	}
 
-// Crunch all occurrences of one pair
+static void pair_insert (pair_t * pair)
+	{
+	pair_t ** slot = pair_index + pair_hash (pair->left, pair->right);
+	pair->hash_next = *slot;
+	*slot = pair;
+	}
 
-static int crunch_pair (pair_t * pair)
+static void pair_unlink (pair_t * pair)
 	{
-	int shrink = 0;  // no shrink
+	pair_t ** slot = pair_index + pair_hash (pair->left, pair->right);
+	while (*slot != pair) slot = &(*slot)->hash_next;
+	*slot = pair->hash_next;
+	}
 
-	// Check all pair occurrences
 
-	symbol_t * sym = NULL;
+// Pair bucket helpers
+// A pair is queued when its node is linked in a bucket
 
-	list_t * node_prev = &pos_root;
-	list_t * node_left = pos_root.next;
-	list_t * node_right = node_left->next;
-	list_t * node_next = node_right->next;
+static int pair_comp (list_t * node1, list_t * node2)
+	{
+	ulong_t order1 = ((pair_t *) node1)->order;  // node as first member
+	ulong_t order2 = ((pair_t *) node2)->order;
 
-	while (1)
+	return (order1 > order2) - (order1 < order2);
+	}
+
+static void bucket_add (pair_t * pair)
+	{
+	// Symmetric pairs are never selected
+	if (pair->left == pair->right)
 		{
-		position_t * pos_left = (position_t *) node_left;  // node as first member
-		if (pos_left->pair == pair)
-			{
-			// Consider previous pair if any
+		list_init (&pair->node);
+		return;
+		}
 
-			if (node_prev != &pos_root)
-				{
-				position_t * pos_prev = (position_t *) node_prev;  // node as first member
-				if (pos_prev->pair)
-					{
-					dec_pair (pos_prev->pair);
-					pos_prev->pair = NULL;
-					hole_add (pos_prev);
-					}
-				}
+	list_t * root = bucket_root + pair->count;
 
-			// Consider next pair if any
+	// Appending keeps the bucket sorted in most cases
+	if (root->prev != root && pair_comp (root->prev, &pair->node) > 0)
+		bucket_sort [pair->count] = 1;
 
-			if (node_next != &pos_root)
-				{
-				position_t * pos_right = (position_t *) node_right;  // node as first member
-				if (pos_right->pair)
-					{
-					dec_pair (pos_right->pair);
-					// position will be crunched later
-					// pos_right->pair = NULL;
-					// hole_add (pos_right);
-					}
-				}
+	list_add_tail (root, &pair->node);
 
-			// Replace current pair by new symbol
+	if (pair->count > bucket_top) bucket_top = pair->count;
+	}
 
-			symbol_t * sym_left = pair->left;
-			symbol_t * sym_right = pair->right;
+static void bucket_remove (pair_t * pair)
+	{
+	list_remove (&pair->node);
+	list_init (&pair->node);
+	}
 
-			if (!sym)
-				{
-				sym = sym_add ();
+static uchar pair_queued (pair_t * pair)
+	{
+	return (pair->node.next != &pair->node);
+	}
 
-				sym->base = pos_left->base;
-				sym->size = sym_left->size + sym_right->size;
 
-				sym->left = sym_left;
-				sym_left->sym_count++;
+// Get the most duplicated pair
+// Ties are broken by the lowest order
 
-				sym->right = sym_right;
-				sym_right->sym_count++;
+static pair_t * bucket_max ()
+	{
+	while (bucket_top >= 2)
+		{
+		list_t * root = bucket_root + bucket_top;
+		if (root->next != root)
+			{
+			if (bucket_sort [bucket_top])
+				{
+				list_sort (root, pair_comp);
+				bucket_sort [bucket_top] = 0;
 				}
 
-			sym_left->pos_count--;
-			sym_right->pos_count--;
-			sym->pos_count++;
+			return (pair_t *) root->next;  // node as first member
+			}
 
-			pos_left->sym = sym;
+		bucket_top--;
+		}
 
-			dec_pair (pair);
-			pos_left->pair = NULL;
+	return NULL;
+	}
 
-			if (node_next != &pos_root)
-				hole_add (pos_left);
 
-			// Shift frame end to the left
+// Tie-break key of a new pair
+// The creation order breaks the remaining ties
 
-			list_remove (node_right);
-			free ((position_t *) node_right);  // node as first member
-			node_right = NULL;
-			pos_count--;
-			shrink = 1;
+static uint_t tie_mix (uint_t val)
+	{
+	val ^= crunch_tie * 0x9E3779B9u;
+	val *= 0x85EBCA6Bu;
+	val ^= val >> 13;
+	val *= 0xC2B2AE35u;
+	val ^= val >> 16;
+	return val;
+	}
 
-			if (node_next == &pos_root) break;
-			node_prev = node_left;
-			node_left = node_next;
-			node_right = node_left->next;
-			if (node_right == &pos_root) break;
-			node_next = node_right->next;
-			}
+static ulong_t pair_tie (symbol_t * left, symbol_t * right, uint_t order)
+	{
+	switch (crunch_tie)
+		{
+		case TIE_OLD:
+			return order;
 
-		else
-			{
-			if (node_next == &pos_root) break;
-			list_t * node = node_next->next;
-			node_prev = node_left;
-			node_left = node_right;
-			node_right = node_next;
-			node_next = node;
-			}
-		}
+		case TIE_LONG:
+			return ((ulong_t) (2 * FRAME_MAX - left->size - right->size) << 32) | order;
 
-	return shrink;
+		default:
+			return ((ulong_t) tie_mix (order) << 32) | order;
+		}
 	}
 
 
-// Crunch all pairs
-// Performed alone or before repeat crunch
+// Create a new pair
+// Queued in its bucket by the caller
 
-void crunch_word ()
+static pair_t * pair_new (symbol_t * left, symbol_t * right)
 	{
-	// Iterate on pair scan & crunch
+	pair_t * pair = pool_alloc (&pair_pool);
 
-	list_init (&pair_root);
+	pair->count = 0;
+	pair->serial = pair_order++;
+	pair->order = pair_tie (left, right, pair->serial);
 
-	while (1)
-		{
-		scan_pair ();
+	pair->left = left;
+	pair->right = right;
 
-		// Look for the pair the most duplicated
+	pair->occ_head = POS_NONE;
+	pair->occ_tail = POS_NONE;
 
-		uint_t count_max = 0;
-		pair_t * pair_max = NULL;
+	pair_insert (pair);
+	return pair;
+	}
 
-		list_t * node = pair_root.next;
-		while (node != &pair_root)
-			{
-			pair_t * pair = (pair_t *) node;  // node as first member
 
-			// Skip any symmetric pair
+// Pair at position now
+// Append to the occurrences
 
-			if (pair->left != pair->right)
-				{
-				if (pair->count > count_max)
-					{
-					count_max = pair->count;
-					pair_max = pair;
-					}
-				}
+static void pos_pair_add (uint_t pos, pair_t * pair)
+	{
+	pos_pair [pos] = pair;
 
-			node = node->next;
-			}
+	occ_prev [pos] = pair->occ_tail;
+	occ_next [pos] = POS_NONE;
 
-		if (count_max < 2) break;
+	if (pair->occ_tail != POS_NONE)
+		occ_next [pair->occ_tail] = pos;
+	else
+		pair->occ_head = pos;
 
-		if (!crunch_pair (pair_max)) break;
-		}
+	pair->occ_tail = pos;
 	}
 
 
-// Crunch all repeated symbols
-// Performed alone or after word crunch
+// Count the first pairs over a range of the frame
+// Each job has its own pair of interleaved tables
+// The pair at the end of the range reads the next byte of the frame
 
-void crunch_rep ()
+struct scan_job_s
 	{
-	list_t * node_left = pos_root.next;
-	while ((node_left != pos_root.prev) && (node_left != &pos_root))
-		{
-		position_t * pos_left = structof (position_t, node, node_left);
+	uint_t first;
+	uint_t last;
 
-		symbol_t * sym_left = pos_left->sym;
-		symbol_t * sym_rep = NULL;
+	ushort_t * hist0;
+	ushort_t * hist1;
 
-		list_t * node_right = node_left->next;
-		while (node_right != &pos_root)
-			{
-			position_t * pos_right = structof (position_t, node, node_right);
-			symbol_t * sym_right = pos_right->sym;
-			if (sym_left != sym_right) break;
+	pthread_t thread;
+	};
 
-			// Replace current symbol by repeat
+typedef struct scan_job_s scan_job_t;
 
-			if (!sym_rep)
-				{
-				if (pos_left->pair) dec_pair (pos_left->pair);
-				pos_left->pair = NULL;
+static void * scan_count (void * arg)
+	{
+	scan_job_t * job = (scan_job_t *) arg;
 
-				sym_rep = sym_add ();
-				sym_rep->repeat = 1;
+	uint_t first = job->first;
+	uint_t last = job->last;
 
-				pos_left->sym = sym_rep;
-				sym_rep->pos_count = 1;
-				sym_left->pos_count--;
-				sym_left->rep_pos++;
+	ushort_t * hist0 = job->hist0;
+	ushort_t * hist1 = job->hist1;
 
-				sym_rep->rep_count = 1;
-				sym_left->rep_count++;
+	// Extract the pair keys in a vectorizable loop
 
-				sym_rep->code = sym_left->code;
-				sym_rep->base = sym_left->base;
-				sym_rep->size = sym_left->size;
+	for (uint_t i = first; i < last; i++)
+		pair_key [i] = (frame_in [i] << 8) | frame_in [i + 1];
 
-				sym_rep->left = sym_left;
+	// Count with two interleaved tables
+	// Each count is at most half the frame
+
+	uint_t i = first;
+	for (; i + 2 <= last; i += 2)
+		{
+		hist0 [pair_key [i]]++;
+		hist1 [pair_key [i + 1]]++;
+		}
+
+	if (i < last) hist0 [pair_key [i]]++;
+
+	return NULL;
+	}
+
+
+// Scan frame for the first pairs
+// All symbols are still bytes, so the pair counts fit in a direct table
+// filled in a single pass, without any lookup in the pair index
+
+static void scan_first (list_t * new_root)
+	{
+	uint_t last = size_in - 1;  // number of pairs
+
+	// Split the frame in ranges counted in parallel
+	// Not worth a thread for a small range
+
+	uint_t job_count = thread_count;
+	if (job_count > last / SCAN_RANGE_MIN) job_count = last / SCAN_RANGE_MIN;
+	if (job_count < 1) job_count = 1;
+
+	scan_job_t jobs [THREAD_MAX];
+
+	for (uint_t j = 0; j < job_count; j++)
+		{
+		scan_job_t * job = jobs + j;
+
+		job->first = (uint_t) ((unsigned long) last * j / job_count);
+		job->last = (uint_t) ((unsigned long) last * (j + 1) / job_count);
+
+		job->hist0 = pair_hist [2 * j];
+		job->hist1 = pair_hist [2 * j + 1];
+		}
+
+	for (uint_t j = 1; j < job_count; j++)
+		{
+		if (pthread_create (&jobs [j].thread, NULL, scan_count, jobs + j))
+			error (1, 0, "cannot create thread");
+		}
+
+	scan_count (jobs);
+
+	for (uint_t j = 1; j < job_count; j++)
+		pthread_join (jobs [j].thread, NULL);
+
+	// Create the pairs in frame order with their final count
+	// merged from all the tables
+
+	uint_t hist_count = 2 * job_count;
+
+	for (uint_t i = 0; i < last; i++)
+		{
+		uint_t key = pair_key [i];
+		pair_t * pair = pair_direct [key];
+
+		if (!pair)
+			{
+			pair = pair_new (pos_sym [i], pos_sym [i + 1]);
+			list_add_tail (new_root, &pair->node);
+
+			uint_t count = 0;
+			for (uint_t h = 0; h < hist_count; h++)
+				{
+				count += pair_hist [h][key];
+				pair_hist [h][key] = 0;
 				}
 
-			sym_right->pos_count--;
+			pair->count = count;
+			pair_direct [key] = pair;
+			}
+
+		pos_pair_add (i, pair);
+		}
+
+	// Clear the direct table for the next job
+
+	for (uint_t i = 0; i < last; i++)
+		pair_direct [pair_key [i]] = NULL;
+
+	pair_base = 0;
+	}
+
+
+// Scan frame holes for new pairs
+// Each hole is counted against the pair index
+
+static void scan_pair ()
+	{
+	// New pairs are queued after the scan
+	// so that they enter their bucket in creation order
+
+	list_t new_root;
+	list_init (&new_root);
+
+	uint_t new_order = pair_order;
 
-			sym_rep->rep_count++;
-			sym_right->rep_count++;
+	if (pair_base) scan_first (&new_root);
 
-			if (pos_right->pair) dec_pair (pos_right->pair);
-			// position will be crunched later
-			// pos_right->pair = NULL;
-			// pos_right->sym = NULL;
+	for (uint_t h = 0; h < hole_count; h++)
+		{
+		uint_t pos_left = hole_pos [h];
+		uint_t pos_right = pos_next [pos_left];
+
+		// In a batch round, a later pair can remove or end the hole,
+		// or add it twice, so skip the stale ones
 
-			// Shift frame end to the left
+		if (!pos_sym [pos_left] || pos_pair [pos_left] || pos_right == POS_NONE)
+			continue;
 
-			list_t * node_next = node_right->next;
-			list_remove (node_right);
-			free (pos_right);
-			node_right = node_next;
+		symbol_t * sym_left = pos_sym [pos_left];
+		symbol_t * sym_right = pos_sym [pos_right];
 
-			pos_count--;
+		pair_t * pair = pair_find (sym_left, sym_right);
+		if (pair)
+			{
+			if (pair->serial < new_order && pair_queued (pair))
+				{
+				bucket_remove (pair);
+				pair->count++;
+				bucket_add (pair);
+				}
+			else
+				{
+				pair->count++;
+				}
 			}
+		else
+			{
+			// Replace hole by a new pair
 
-		node_left = node_right;
+			pair = pair_new (sym_left, sym_right);
+			list_add_tail (&new_root, &pair->node);
+			pair->count = 1;
+			}
+
+		pos_pair_add (pos_left, pair);
+		}
+
+	hole_count = 0;
+
+	while (new_root.next != &new_root)
+		{
+		pair_t * pair = (pair_t *) new_root.next;  // node as first member
+		list_remove (&pair->node);
+		bucket_add (pair);
 		}
 	}
 
 
-// Keep duplicated symbols
+static void dec_pair (pair_t * pair)
+	{
+	pair->count--;
+
+	if (!pair->count)
+		{
+		list_remove (&pair->node);
+		pair_unlink (pair);
+		// Zero the pair to detect bad pointers
+		memset (pair, 0, sizeof (pair_t));
+		pool_free (&pair_pool, pair);
+		return;
+		}
+
+	if (pair_queued (pair))
+		{
+		bucket_remove (pair);
+		bucket_add (pair);
+		}
+	}
+
 
-uint_t keep_dup ()
+// Remove a position from the occurrences of its pair
+
+static void pos_unpair (uint_t pos)
 	{
-	uint_t count = 0;
+	pair_t * pair = pos_pair [pos];
+
+	uint_t prev = occ_prev [pos];
+	uint_t next = occ_next [pos];
+
+	if (prev != POS_NONE)
+		occ_next [prev] = next;
+	else
+		pair->occ_head = next;
+
+	if (next != POS_NONE)
+		occ_prev [next] = prev;
+	else
+		pair->occ_tail = prev;
+
+	dec_pair (pair);
+	pos_pair [pos] = NULL;
+	}
+
+
+// Crunch all occurrences of one pair
+// Only the pair occurrences and their neighbours are visited
+
+static int crunch_pair (pair_t * pair)
+	{
+	int shrink = 0;  // no shrink
+
+	symbol_t * sym = NULL;
+
+	symbol_t * sym_left = pair->left;
+	symbol_t * sym_right = pair->right;
+
+	// The occurrences are in frame order
+	// and an asymmetric pair never overlaps itself
+
+	uint_t count = pair->count;
+	while (count--)
+		{
+		uint_t pos_left = pair->occ_head;
+		uint_t pos_right = pos_next [pos_left];
+
+		// Consider previous pair if any
+
+		uint_t pos_before = pos_prev [pos_left];
+		if (pos_before != POS_NONE && pos_pair [pos_before])
+			{
+			pos_unpair (pos_before);
+			hole_add (pos_before);
+			}
+
+		// Consider next pair if any
+		// Position will be crunched later
+
+		if (pos_pair [pos_right]) pos_unpair (pos_right);
+
+		// Replace current pair by new symbol
+
+		if (!sym)
+			{
+			sym = sym_derive (sym_left, sym_right, pos_left);
+			}
+
+		sym_left->pos_count--;
+		sym_right->pos_count--;
+		sym->pos_count++;
+
+		pos_sym [pos_left] = sym;
+		pos_unpair (pos_left);  // pair released with last occurrence
+
+		if (pos_next [pos_right] != POS_NONE)
+			hole_add (pos_left);
+
+		// Shift frame end to the left
+
+		pos_remove (pos_right);
+		shrink = 1;
+		}
+
+	return shrink;
+	}
+
+
+// Seed the long repeated words before the pair crunch
+// Found as maximal repeats in the suffix array of the frame,
+// longest first, without overlapping a seeded occurrence
+
+#define SEED_WORK 32  // scanned suffixes per frame code
+
+static uint_t seed_sa [FRAME_MAX];
+static uint_t seed_lcp [FRAME_MAX];
+static uint_t seed_rank [FRAME_MAX];  // suffixes with a long common prefix
+static uint_t seed_occ [FRAME_MAX];
+static uchar seed_done [FRAME_MAX];
+static uchar seed_cover [FRAME_MAX];
+
+static int rank_comp (const void * v1, const void * v2)
+	{
+	uint_t r1 = *(uint_t *) v1;
+	uint_t r2 = *(uint_t *) v2;
+
+	uint_t len1 = seed_lcp [r1];
+	uint_t len2 = seed_lcp [r2];
+
+	if (len1 != len2) return (len1 < len2) ? 1 : -1;
+	return (r1 > r2) - (r1 < r2);
+	}
+
+static int occ_comp (const void * v1, const void * v2)
+	{
+	uint_t p1 = *(uint_t *) v1;
+	uint_t p2 = *(uint_t *) v2;
+
+	return (p1 > p2) - (p1 < p2);
+	}
+
+
+// Balanced tree of derived symbols over a word of base symbols
+
+static symbol_t * seed_tree (uint_t pos, uint_t len)
+	{
+	if (len == 1) return pos_sym [pos];
+
+	uint_t half = len / 2;
+
+	symbol_t * left = seed_tree (pos, half);
+	symbol_t * right = seed_tree (pos + half, len - half);
+
+	return sym_derive (left, right, pos);
+	}
+
+
+// Replace a word of base symbols by its symbol
+// Before the first pair scan
+
+void word_add (symbol_t * sym, uint_t pos)
+	{
+	uint_t len = sym->size;
+	uint_t end = pos + len;
+
+	for (uint_t p = pos; p < end; p++)
+		pos_sym [p]->pos_count--;
+
+	pos_sym [pos] = sym;
+	sym->pos_count++;
+
+	// Shift frame end to the left
+
+	uint_t next = pos_next [end - 1];
+
+	for (uint_t p = pos + 1; p < end; p++)
+		pos_sym [p] = NULL;
+
+	pos_next [pos] = next;
+	if (next != POS_NONE) pos_prev [next] = pos;
+
+	pos_count -= len - 1;
+	}
+
+
+// The symbols are no longer all bytes
+// so the first pair scan takes all the positions as holes
+
+void word_holes ()
+	{
+	pair_base = 0;
+	hole_count = 0;
+
+	uint_t pos = pos_head;
+	while (pos != POS_NONE)
+		{
+		if (pos_next [pos] != POS_NONE) hole_add (pos);
+		pos = pos_next [pos];
+		}
+	}
+
+
+// Replace a word occurrence by its symbol
+// and mark the covered positions
+
+static void seed_add (symbol_t * sym, uint_t pos)
+	{
+	memset (seed_cover + pos, 1, sym->size);
+	word_add (sym, pos);
+	}
+
+
+static void seed_word ()
+	{
+	seed_count = 0;
+	seed_size = 0;
+
+	suffix_sort (frame_in, size_in, seed_sa, seed_lcp);
+
+	uint_t rank_count = 0;
+	for (uint_t r = 1; r < size_in; r++)
+		{
+		if (seed_lcp [r] >= seed_len) seed_rank [rank_count++] = r;
+		}
+
+	qsort (seed_rank, rank_count, sizeof (uint_t), rank_comp);
+
+	memset (seed_done, 0, size_in);
+	memset (seed_cover, 0, size_in);
+
+	// Bound the scan on long runs, where the intervals nest deeply
+
+	uint_t work = 0;
+	uint_t work_max = SEED_WORK * size_in;
+
+	for (uint_t c = 0; c < rank_count; c++)
+		{
+		uint_t r = seed_rank [c];
+		if (seed_done [r]) continue;
+
+		// Interval of the suffixes sharing the word
+
+		uint_t len = seed_lcp [r];
+
+		uint_t first = r - 1;
+		while (first > 0 && seed_lcp [first] >= len) first--;
+
+		uint_t last = r;
+		while (last + 1 < size_in && seed_lcp [last + 1] >= len) last++;
+
+		work += last - first + 1;
+		if (work > work_max) break;
+
+		for (uint_t j = first + 1; j <= last; j++)
+			{
+			if (seed_lcp [j] == len) seed_done [j] = 1;
+			}
+
+		// Keep the occurrences in frame order without overlap
+		// A seeded word is not shorter, so it covers one end of any overlap
+
+		uint_t occ_count = 0;
+		for (uint_t j = first; j <= last; j++)
+			seed_occ [occ_count++] = seed_sa [j];
+
+		qsort (seed_occ, occ_count, sizeof (uint_t), occ_comp);
+
+		uint_t keep = 0;
+		uint_t end = 0;
+
+		for (uint_t o = 0; o < occ_count; o++)
+			{
+			uint_t pos = seed_occ [o];
+			if (pos < end || seed_cover [pos] || seed_cover [pos + len - 1]) continue;
+
+			seed_occ [keep++] = pos;
+			end = pos + len;
+			}
+
+		if (keep < 2) continue;
+
+		symbol_t * sym = seed_tree (seed_occ [0], len);
+
+		for (uint_t o = 0; o < keep; o++)
+			seed_add (sym, seed_occ [o]);
+
+		seed_count++;
+		seed_size += keep * len;
+		}
+
+	if (seed_count) word_holes ();
+	}
+
+
+// Check a pair against the symbols of the pairs already crunched in the round
+// Pairs without common symbol cannot overlap
+
+static uchar pair_free (pair_t * pair, symbol_t ** used, uint_t used_count)
+	{
+	for (uint_t u = 0; u < used_count; u++)
+		{
+		if (pair->left == used [u] || pair->right == used [u])
+			return 0;
+		}
+
+	return 1;
+	}
+
+
+// Get the next most duplicated pair for the round
+// Not below half the count of the first pair of the round
+
+static pair_t * bucket_next (uint_t count_min, symbol_t ** used, uint_t used_count)
+	{
+	for (uint_t count = bucket_top; count >= count_min; count--)
+		{
+		list_t * root = bucket_root + count;
+		if (root->next == root) continue;
+
+		if (bucket_sort [count])
+			{
+			list_sort (root, pair_comp);
+			bucket_sort [count] = 0;
+			}
+
+		list_t * node = root->next;
+		while (node != root)
+			{
+			pair_t * pair = (pair_t *) node;  // node as first member
+			if (pair_free (pair, used, used_count)) return pair;
+
+			node = node->next;
+			}
+		}
+
+	return NULL;
+	}
+
+
+// Wall clock in milliseconds
+
+static ulong_t clock_ms ()
+	{
+	struct timespec now;
+	clock_gettime (CLOCK_MONOTONIC, &now);
+
+	return (ulong_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+	}
+
+
+// Crunch all pairs
+// Performed alone or before repeat crunch
+
+void crunch_word ()
+	{
+	ulong_t limit = crunch_budget ? clock_ms () + crunch_budget : 0;
+
+	// Iterate on pair scan & crunch
+
+	memset (pair_index, 0, sizeof (pair_index));
+	pool_reset (&pair_pool);
+
+	for (uint_t i = 0; i < BUCKET_MAX; i++)
+		list_init (bucket_root + i);
+
+	memset (bucket_sort, 0, sizeof (bucket_sort));
+	bucket_top = 0;
+	pair_order = 0;
+
+	crunch_round = 0;
+	crunch_count = 0;
+	crunch_left = 0;
+
+	// Not after a warm start, as the words are no longer bytes
+	if (seed_len && pos_count == size_in) seed_word ();
+
+	symbol_t * used [2 * CRUNCH_BATCH_MAX];
+
+	while (1)
+		{
+		scan_pair ();
+
+		// Look for the pair the most duplicated
+		// Symmetric pairs are not queued
+
+		pair_t * pair_max = bucket_max ();
+		if (!pair_max) break;
+
+		// Stop early on level or time budget
+
+		if (pair_max->count < crunch_min || (limit && clock_ms () > limit))
+			{
+			crunch_left = pair_max->count;
+			break;
+			}
+
+		crunch_round++;
+
+		// Crunch the next pairs without common symbols in the same round
+		// The holes of all the pairs are scanned once in the next round
+
+		uint_t count_min = (pair_max->count + 1) / 2;
+		if (count_min < crunch_min) count_min = crunch_min;
+
+		uint_t used_count = 0;
+		uint_t batch = 0;
+
+		while (1)
+			{
+			used [used_count++] = pair_max->left;
+			used [used_count++] = pair_max->right;
+
+			// Stop requeuing the pair while it is crunched
+			bucket_remove (pair_max);
+
+			crunch_pair (pair_max);
+			crunch_count++;
+
+			if (++batch >= crunch_batch) break;
+
+			pair_max = bucket_next (count_min, used, used_count);
+			if (!pair_max) break;
+			}
+		}
+	}
+
+
+// Length of the run of the same byte code from a frame offset
+// Compare whole blocks of the frame when available
+
+static uint_t run_base (uint_t pos)
+	{
+	uchar_t code = frame_in [pos];
+	uint_t end = pos + 1;
+
+	// Most codes are not repeated
+	if (end == size_in || frame_in [end] != code) return 1;
+
+#if defined (__AVX2__)
+	__m256i pattern = _mm256_set1_epi8 (code);
+	while (end + 32 <= size_in)
+		{
+		__m256i block = _mm256_loadu_si256 ((__m256i *) (frame_in + end));
+		uint_t diff = ~_mm256_movemask_epi8 (_mm256_cmpeq_epi8 (block, pattern));
+		if (diff) return end + __builtin_ctz (diff) - pos;
+		end += 32;
+		}
+#elif defined (__SSE2__)
+	__m128i pattern = _mm_set1_epi8 (code);
+	while (end + 16 <= size_in)
+		{
+		__m128i block = _mm_loadu_si128 ((__m128i *) (frame_in + end));
+		uint_t diff = _mm_movemask_epi8 (_mm_cmpeq_epi8 (block, pattern)) ^ 0xFFFF;
+		if (diff) return end + __builtin_ctz (diff) - pos;
+		end += 16;
+		}
+#endif
+
+	while (end < size_in && frame_in [end] == code) end++;
+	return end - pos;
+	}
+
+
+// Replace a run of the same symbol by a repeat symbol
+
+static void rep_add (uint_t pos_left, uint_t count, uint_t pos_end)
+	{
+	symbol_t * sym_left = pos_sym [pos_left];
+
+	if (pos_pair [pos_left]) pos_unpair (pos_left);
+
+	symbol_t * sym_rep = sym_repeat (sym_left, count);
+
+	pos_sym [pos_left] = sym_rep;
+	sym_rep->pos_count++;
+	sym_left->pos_count -= count;
+	sym_left->rep_pos++;
+
+	sym_left->rep_count += count;
+
+	// Shift frame end to the left
+
+	for (uint_t pos = pos_next [pos_left]; pos != pos_end; pos = pos_next [pos])
+		{
+		if (pos_pair [pos]) pos_unpair (pos);
+		pos_sym [pos] = NULL;
+		}
+
+	pos_next [pos_left] = pos_end;
+	if (pos_end != POS_NONE) pos_prev [pos_end] = pos_left;
+
+	pos_count -= count - 1;
+	}
+
+
+// Crunch all repeated symbols
+// Performed alone or after word crunch
+
+void crunch_rep ()
+	{
+	// Before any crunch the sequence is the frame itself
+	// so the runs are found by comparing the byte codes
+
+	uchar frame = (pos_count == size_in);
+
+	uint_t pos_left = pos_head;
+	while ((pos_left != POS_NONE) && (pos_next [pos_left] != POS_NONE))
+		{
+		uint_t count;
+		uint_t pos_end;
+
+		if (frame)
+			{
+			count = run_base (pos_left);
+			pos_end = pos_left + count;
+			if (pos_end == size_in) pos_end = POS_NONE;
+			}
+		else
+			{
+			// Run-length pass over the symbol sequence
+
+			symbol_t * sym_left = pos_sym [pos_left];
+
+			count = 1;
+			pos_end = pos_next [pos_left];
+			while (pos_end != POS_NONE && pos_sym [pos_end] == sym_left)
+				{
+				count++;
+				pos_end = pos_next [pos_end];
+				}
+			}
+
+		if (count > 1) rep_add (pos_left, count, pos_end);
+
+		pos_left = pos_end;
+		}
+	}
+
+
+// Build the cost table from the symbol list
+
+#define TABLE_ALLOC_N(field, n) \
+	tab->field = realloc (tab->field, sizeof (*tab->field) * (n)); \
+	/**/
+
+#define TABLE_ALLOC(field) TABLE_ALLOC_N (field, count)
+
+#define TABLE_NONE ((uint_t) -1)
+
+void table_build (table_t * tab)
+	{
+	uint_t count = sym_count;
+	tab->count = count;
+
+	TABLE_ALLOC (sym)
+	TABLE_ALLOC (left)
+	TABLE_ALLOC (right)
+	TABLE_ALLOC (size)
+	TABLE_ALLOC (repeat)
+	TABLE_ALLOC (pos_count)
+	TABLE_ALLOC (rep_pos)
+	TABLE_ALLOC (rep_count)
+
+	TABLE_ALLOC (sym_count)
+	TABLE_ALLOC (use_count)
+	TABLE_ALLOC (keep)
+	TABLE_ALLOC (len)
+	TABLE_ALLOC (cost)
+	TABLE_ALLOC (pcost)
+	TABLE_ALLOC (gain)
+
+	TABLE_ALLOC (best_keep)
+	TABLE_ALLOC (best_len)
+
+	TABLE_ALLOC (par_head)
+	TABLE_ALLOC_N (par_next, 2 * count)
+
+	TABLE_ALLOC (heap)
+	TABLE_ALLOC (heap_slot)
+	TABLE_ALLOC (queue)
+	TABLE_ALLOC (queued)
+
+	tab->heap_count = 0;
+	tab->queue_count = 0;
 
 	list_t * node = sym_root.next;
-	for (uint_t i = 0; i < sym_count; i++)
+	for (uint_t i = 0; i < count; i++)
 		{
 		symbol_t * sym = structof (symbol_t, node, node);
 
-		sym->use_count = sym->pos_count + sym->sym_count + sym->rep_pos;
-		if (sym->use_count > 1 || (!sym->repeat && sym->rep_count > 1))
+		tab->sym [i] = sym;
+		tab->left [i] = sym->left ? sym->left->id : 0;
+		tab->right [i] = sym->right ? sym->right->id : 0;
+		tab->size [i] = sym->size;
+		tab->repeat [i] = sym->repeat;
+		tab->pos_count [i] = sym->pos_count;
+		tab->rep_pos [i] = sym->rep_pos;
+		tab->rep_count [i] = sym->rep_count;
+
+		tab->sym_count [i] = sym->sym_count;
+		tab->use_count [i] = sym->use_count;
+		tab->keep [i] = sym->keep;
+		tab->len [i] = 0;
+		tab->best_keep [i] = sym->keep;
+		tab->best_len [i] = 0;
+		tab->cost [i] = 0;
+		tab->pcost [i] = 0;
+		tab->gain [i] = 0;
+
+		tab->heap_slot [i] = TABLE_NONE;
+		tab->queued [i] = 0;
+
+		node = node->next;
+		}
+
+	// Link the parents of each symbol
+
+	for (uint_t i = 0; i < count; i++)
+		tab->par_head [i] = TABLE_NONE;
+
+	for (uint_t i = 0; i < count; i++)
+		{
+		if (tab->size [i] == 1) continue;
+
+		uint_t edge = 2 * i;
+		tab->par_next [edge] = tab->par_head [tab->left [i]];
+		tab->par_head [tab->left [i]] = edge;
+
+		if (tab->repeat [i]) continue;
+
+		edge++;
+		tab->par_next [edge] = tab->par_head [tab->right [i]];
+		tab->par_head [tab->right [i]] = edge;
+		}
+	}
+
+
+// Store the selection back to the symbols
+
+void table_store (table_t * tab)
+	{
+	for (uint_t i = 0; i < tab->count; i++)
+		{
+		symbol_t * sym = tab->sym [i];
+
+		sym->keep = tab->keep [i];
+		sym->len = tab->len [i];
+		sym->cost = tab->cost [i];
+		sym->gain = tab->gain [i];
+		}
+	}
+
+
+// Copy a table to evaluate another selection
+// The tree fields are shared, the selection fields are owned
+
+#define TABLE_FORK(field) \
+	tab->field = malloc (sizeof (*tab->field) * count); \
+	memcpy (tab->field, from->field, sizeof (*tab->field) * count); \
+	/**/
+
+void table_fork (table_t * tab, table_t * from)
+	{
+	uint_t count = from->count;
+	*tab = *from;
+
+	TABLE_FORK (sym_count)
+	TABLE_FORK (use_count)
+	TABLE_FORK (keep)
+	TABLE_FORK (len)
+	TABLE_FORK (cost)
+	TABLE_FORK (pcost)
+	TABLE_FORK (gain)
+
+	TABLE_FORK (best_keep)
+	TABLE_FORK (best_len)
+
+	TABLE_FORK (heap)
+	TABLE_FORK (heap_slot)
+	TABLE_FORK (queue)
+	TABLE_FORK (queued)
+	}
+
+void table_free (table_t * tab)
+	{
+	free (tab->sym_count);
+	free (tab->use_count);
+	free (tab->keep);
+	free (tab->len);
+	free (tab->cost);
+	free (tab->pcost);
+	free (tab->gain);
+
+	free (tab->best_keep);
+	free (tab->best_len);
+
+	free (tab->heap);
+	free (tab->heap_slot);
+	free (tab->queue);
+	free (tab->queued);
+	}
+
+
+// Selection heap
+// Kept symbols by increasing gain, so the first one is the next to drop
+
+static int heap_less (table_t * tab, uint_t i1, uint_t i2)
+	{
+	int gain1 = tab->gain [i1];
+	int gain2 = tab->gain [i2];
+
+	if (gain1 != gain2) return gain1 < gain2;
+	return tab->heap_late ? (i1 > i2) : (i1 < i2);
+	}
+
+static void heap_move (table_t * tab, uint_t h, uint_t i)
+	{
+	tab->heap [h] = i;
+	tab->heap_slot [i] = h;
+	}
+
+static void heap_up (table_t * tab, uint_t h)
+	{
+	uint_t i = tab->heap [h];
+
+	while (h > 0)
+		{
+		uint_t up = (h - 1) / 2;
+		if (!heap_less (tab, i, tab->heap [up])) break;
+
+		heap_move (tab, h, tab->heap [up]);
+		h = up;
+		}
+
+	heap_move (tab, h, i);
+	}
+
+static void heap_down (table_t * tab, uint_t h)
+	{
+	uint_t i = tab->heap [h];
+
+	while (1)
+		{
+		uint_t down = 2 * h + 1;
+		if (down >= tab->heap_count) break;
+
+		if (down + 1 < tab->heap_count && heap_less (tab, tab->heap [down + 1], tab->heap [down]))
+			down++;
+
+		if (!heap_less (tab, tab->heap [down], i)) break;
+
+		heap_move (tab, h, tab->heap [down]);
+		h = down;
+		}
+
+	heap_move (tab, h, i);
+	}
+
+static void heap_build (table_t * tab, uchar late)
+	{
+	tab->heap_late = late;
+	tab->heap_count = 0;
+
+	for (uint_t i = 0; i < tab->count; i++)
+		{
+		if (tab->keep [i] && !tab->repeat [i])
+			heap_move (tab, tab->heap_count++, i);
+		else
+			tab->heap_slot [i] = TABLE_NONE;
+		}
+
+	for (uint_t h = tab->heap_count / 2; h-- > 0; )
+		heap_down (tab, h);
+	}
+
+static uint_t heap_pop (table_t * tab)
+	{
+	uint_t i = tab->heap [0];
+	tab->heap_slot [i] = TABLE_NONE;
+
+	if (--tab->heap_count)
+		{
+		heap_move (tab, 0, tab->heap [tab->heap_count]);
+		heap_down (tab, 0);
+		}
+
+	return i;
+	}
+
+static void heap_update (table_t * tab, uint_t i)
+	{
+	heap_up (tab, tab->heap_slot [i]);
+	heap_down (tab, tab->heap_slot [i]);
+	}
+
+
+// Update queue
+// Symbols are updated in creation order, so children before parents
+
+static void queue_add (table_t * tab, uint_t i)
+	{
+	if (tab->queued [i]) return;
+	tab->queued [i] = 1;
+
+	uint_t q = tab->queue_count++;
+	while (q > 0)
+		{
+		uint_t up = (q - 1) / 2;
+		if (tab->queue [up] < i) break;
+
+		tab->queue [q] = tab->queue [up];
+		q = up;
+		}
+
+	tab->queue [q] = i;
+	}
+
+static uint_t queue_pop (table_t * tab)
+	{
+	uint_t i = tab->queue [0];
+	tab->queued [i] = 0;
+
+	uint_t last = tab->queue [--tab->queue_count];
+	uint_t q = 0;
+
+	while (1)
+		{
+		uint_t down = 2 * q + 1;
+		if (down >= tab->queue_count) break;
+
+		if (down + 1 < tab->queue_count && tab->queue [down + 1] < tab->queue [down])
+			down++;
+
+		if (last < tab->queue [down]) break;
+
+		tab->queue [q] = tab->queue [down];
+		q = down;
+		}
+
+	if (tab->queue_count) tab->queue [q] = last;
+	return i;
+	}
+
+
+// Keep duplicated symbols
+
+uint_t keep_dup (table_t * tab)
+	{
+	uint_t count = 0;
+
+	for (uint_t i = 0; i < tab->count; i++)
+		{
+		uint_t use = tab->pos_count [i] + tab->sym_count [i] + tab->rep_pos [i];
+		tab->use_count [i] = use;
+
+		// Repeat symbols are never defined, but shared by their runs
+
+		if (!tab->repeat [i] && (use > 1 || tab->rep_count [i] > 1))
 			{
 			// Duplicated or repeated symbols are presumed valuable
 			// until cost computation confirms or not
-			sym->keep = 1;
+			tab->keep [i] = 1;
 			count++;
 			}
 		else
 			{
-			sym->keep = 0;
+			tab->keep [i] = 0;
 			}
-
-		node = node->next;
 		}
 
 	return count;
 	}
 
 
+// Truncate the selection to the kept symbols with the best gains
+// Drop the lowest gains first, ties broken by the latest symbol
+
+void keep_trunc (table_t * tab, uint keep_max)
+	{
+	if (tab->keep_count <= keep_max) return;
+
+	heap_build (tab, 1);  // latest first
+
+	while (tab->heap_count > keep_max)
+		tab->keep [heap_pop (tab)] = 0;
+
+	tab->keep_count = keep_max;
+	}
+
+
 // Dropping a symbol in the tree makes it "transparent"
 // i.e. increases the usage counts of its kept children
+// The changed symbols are queued for update
 
-void sym_drop (symbol_t * sym, uint increment)
+void sym_drop (table_t * tab, uint_t i, uint increment)
 	{
 	// Stop propagating the increment at kept or leaf symbol
-	if (sym->keep || sym->size == 1)
+	if (tab->keep [i] || tab->size [i] == 1)
 		{
-		sym->sym_count += increment;
-		sym->use_count = sym->pos_count + sym->sym_count;
+		tab->sym_count [i] += increment;
+		tab->use_count [i] = tab->pos_count [i] + tab->sym_count [i];
+		queue_add (tab, i);
 		}
 	else
 		{
 		// Propagate the increment to children
-		sym_drop (sym->left, increment);
-		sym_drop (sym->right, increment);
+		sym_drop (tab, tab->left [i], increment);
+		sym_drop (tab, tab->right [i], increment);
 		}
 	}
 
 
+// Definition length of a derived symbol
+// A kept child is referenced, a dropped one is expanded
+
+static uint def_len (table_t * tab, uint_t i)
+	{
+	uint_t left = tab->left [i];
+	uint_t right = tab->right [i];
+
+	return (tab->keep [left] ? 1 : tab->len [left])
+		+ (tab->keep [right] ? 1 : tab->len [right]);
+	}
+
+
 // Compute symbol cost in SE algorithm
 // Decide whether to define it (keep) or not (drop)
 
-uint sym_cost_se (symbol_t * sym, uchar select)
+uint sym_cost_se (table_t * tab, uint_t i, uchar select)
 	{
 	uint use_cost;
 	uint def_cost;
-	uint ref_cost = 1 + ref_bit;  // 1 bit for reference prefix '1'
+	uint ref_cost = 1 + tab->ref_bit;  // 1 bit for reference prefix '1'
 
 	uint drop_cost;
+	uint use_count = tab->use_count [i];
 
-	if (sym->size == 1)
+	if (tab->size [i] == 1)
 		{
 		// Base symbol
 
-		sym->len = 1;
+		tab->len [i] = 1;
 		use_cost = 1 + 8;  // 1 bit for base prefix '0' and 8 bits for base code
 		def_cost = use_cost;
-		drop_cost = sym->use_count * use_cost;
+		drop_cost = use_count * use_cost;
 		}
 	else
 		{
 		// Derived symbol
 
-		sym->len = (sym->left->keep ? 1 : sym->left->len)
-			+ (sym->right->keep ? 1 : sym->right->len);
+		tab->len [i] = def_len (tab, i);
 
-		use_cost = sym->left->cost + sym->right->cost;
-		def_cost = sym->len;  // number of next flags = definition length
-		drop_cost = (sym->use_count - 1) * use_cost;
+		use_cost = tab->cost [tab->left [i]] + tab->cost [tab->right [i]];
+		def_cost = tab->len [i];  // number of next flags = definition length
+		drop_cost = (use_count - 1) * use_cost;
 		}
 
-	uint keep_cost = def_cost + sym->use_count * ref_cost;
+	uint keep_cost = def_cost + use_count * ref_cost;
 
-	sym->gain = drop_cost - keep_cost;
+	tab->gain [i] = drop_cost - keep_cost;
 
 	// Keep or drop the symbol according to the cost gain
 
 	if (select)
 		{
-		uchar keep = (sym->gain > 0) ? 1 : 0;
-		sym->keep = keep;
-		keep_count += keep;
+		uchar keep = (tab->gain [i] > 0) ? 1 : 0;
+		tab->keep [i] = keep;
+		tab->keep_count += keep;
 		}
 
-	if (sym->keep)
+	if (tab->keep [i])
 		{
-		sym->cost = ref_cost;
+		tab->cost [i] = ref_cost;
 		return keep_cost;
 		}
 
-	sym->cost = use_cost;
+	tab->cost [i] = use_cost;
 	return drop_cost;
 	}
 
 // Compute symbol cost in SI algorithm
 // Decide whether to define it (keep) or not (drop)
 
-uint sym_cost_si (symbol_t * sym)
+uint sym_cost_si (table_t * tab, uint_t i)
 	{
 	uint use_cost;
 	uint def_cost;
-	uint ref_cost = 2 + ref_bit;  // 2 bits for reference prefix '11'
+	uint ref_cost = 2 + tab->ref_bit;  // 2 bits for reference prefix '11'
 
 	uint drop_cost;
+	uint use_count = tab->use_count [i];
 
-	if (sym->size == 1)
+	if (tab->size [i] == 1)
 		{
 		// Base symbol
 
-		sym->len = 1;
+		tab->len [i] = 1;
 		use_cost = 1 + 8;  // 1 bit for base prefix
 		def_cost =  2 + use_cost;  // 2 bits for definition prefix '10'
-		drop_cost = sym->use_count * use_cost;
+		drop_cost = use_count * use_cost;
 		}
 	else
 		{
 		// Derived symbol
 
-		sym->len = (sym->left->keep ? 1 : sym->left->len)
-			+ (sym->right->keep ? 1 : sym->right->len);
+		tab->len [i] = def_len (tab, i);
 
-		use_cost = sym->left->cost + sym->right->cost;
-		def_cost = 2 + sym->len;  // number of next flags = definition length
-		drop_cost = (sym->use_count - 1) * use_cost;
+		use_cost = tab->cost [tab->left [i]] + tab->cost [tab->right [i]];
+		def_cost = 2 + tab->len [i];  // number of next flags = definition length
+		drop_cost = (use_count - 1) * use_cost;
 		}
 
-	uint keep_cost = def_cost + (sym->use_count - 1) * ref_cost;
-	sym->gain = drop_cost - keep_cost;
+	uint keep_cost = def_cost + (use_count - 1) * ref_cost;
+	tab->gain [i] = drop_cost - keep_cost;
 
-	if (sym->keep)
+	if (tab->keep [i])
 		{
-		sym->cost = ref_cost;
+		tab->cost [i] = ref_cost;
 		return keep_cost;
 		}
 
-	sym->cost = use_cost;
-	return (sym->size == 1) ? drop_cost : 0;
+	tab->cost [i] = use_cost;
+	return (tab->size [i] == 1) ? drop_cost : 0;
+	}
+
+
+// Select the symbols in SI algorithm
+// Drop the kept symbol with the lowest gain until the reference bits are enough
+// After each drop, only the symbols with changed inputs are updated
+
+uint keep_select_si (table_t * tab, uint keep_max)
+	{
+	uint cost = 0;
+
+	for (uint_t i = 0; i < tab->count; i++)
+		cost += sym_cost_si (tab, i);
+
+	if (tab->keep_count <= keep_max) return cost;
+
+	heap_build (tab, 0);  // earliest first
+
+	while (tab->keep_count > keep_max)
+		{
+		uint_t i = heap_pop (tab);
+
+		tab->keep [i] = 0;
+		tab->keep_count--;
+
+		queue_add (tab, i);
+		sym_drop (tab, i, tab->use_count [i] - 1);
+
+		// The parents of a changed symbol change too
+
+		while (tab->queue_count)
+			{
+			uint_t j = queue_pop (tab);
+
+			uint cost_old = tab->cost [j];
+			uint len_old = tab->len [j];
+
+			sym_cost_si (tab, j);
+			if (tab->heap_slot [j] != TABLE_NONE) heap_update (tab, j);
+
+			if (j != i && tab->cost [j] == cost_old && tab->len [j] == len_old)
+				continue;
+
+			uint_t edge = tab->par_head [j];
+			while (edge != TABLE_NONE)
+				{
+				queue_add (tab, edge >> 1);
+				edge = tab->par_next [edge];
+				}
+			}
+		}
+
+	cost = 0;
+	for (uint_t i = 0; i < tab->count; i++)
+		cost += sym_cost_si (tab, i);
+
+	return cost;
 	}
 
 
 // Compute symbol cost in RSE algorithm
 // Decide whether to define it (keep) or not (drop)
 
-uint sym_cost_rse (symbol_t * sym, uchar select)
+uint sym_cost_rse (table_t * tab, uint_t i, uchar select)
 	{
 	uint use_cost;
 	uint pos_cost;
 	uint def_cost;
 	uint drop_cost;
 
-	if (sym->size == 1)
+	uint ref_bit = tab->ref_bit;
+	uint pos_count = tab->pos_count [i];
+	uint sym_count = tab->sym_count [i];
+	uint rep_pos = tab->rep_pos [i];
+
+	if (tab->size [i] == 1)
 		{
 		// Base symbol
 
-		sym->len = 1;
+		tab->len [i] = 1;
 		use_cost = 1 + 8;  // 1 bit for base prefix '0' and 8 bits for base code
 		pos_cost = use_cost;
 		def_cost = use_cost;
 		// A base symbol can always be repeated
-		drop_cost = sym->pos_count * pos_cost + (sym->sym_count + sym->rep_pos) * use_cost;
+		drop_cost = pos_count * pos_cost + (sym_count + rep_pos) * use_cost;
 		}
 	else
 		{
 		// Derived symbol
 
-		sym->len = (sym->left->keep ? 1 : sym->left->len)
-			+ (sym->right->keep ? 1 : sym->right->len);
+		uint_t left = tab->left [i];
+		uint_t right = tab->right [i];
+
+		tab->len [i] = def_len (tab, i);
 
-		use_cost = sym->left->cost + sym->right->cost;
-		pos_cost = sym->left->pcost + sym->right->pcost;
+		use_cost = tab->cost [left] + tab->cost [right];
+		pos_cost = tab->pcost [left] + tab->pcost [right];
 
-		def_cost = sym->len;  // number of next flags = definition length
+		def_cost = tab->len [i];  // number of next flags = definition length
 		// A derived symbol cannot be repeated if dropped
-		drop_cost = (sym->pos_count + sym->rep_count) * pos_cost + sym->sym_count * use_cost - use_cost;
+		drop_cost = (pos_count + tab->rep_count [i]) * pos_cost + sym_count * use_cost - use_cost;
 		}
 
 	// Any symbol can be repeated if kept
-	uint keep_cost = def_cost + sym->pos_count * (2 + ref_bit) + (sym->sym_count + sym->rep_pos) * (1 + ref_bit);
+	uint keep_cost = def_cost + pos_count * (2 + ref_bit) + (sym_count + rep_pos) * (1 + ref_bit);
 
-	sym->gain = drop_cost - keep_cost;
+	tab->gain [i] = drop_cost - keep_cost;
 
 	// Keep or drop the symbol according to the cost gain
 
 	if (select)
 		{
-		uchar keep = (sym->gain > 0) ? 1 : 0;
-		sym->keep = keep;
-		keep_count += keep;
+		uchar keep = (tab->gain [i] > 0) ? 1 : 0;
+		tab->keep [i] = keep;
+		tab->keep_count += keep;
 		}
 
-	if (sym->keep)
+	if (tab->keep [i])
 		{
-		sym->cost = 1 + ref_bit;
-		sym->pcost = 2 + ref_bit;
+		tab->cost [i] = 1 + ref_bit;
+		tab->pcost [i] = 2 + ref_bit;
 		return keep_cost;
 		}
 
-	sym->cost = use_cost;
-	sym->pcost = pos_cost;
+	tab->cost [i] = use_cost;
+	tab->pcost [i] = pos_cost;
 	return drop_cost;
 	}
 
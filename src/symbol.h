@@ -6,6 +6,7 @@
 
 #include "common.h"
 #include "list.h"
+#include "stream.h"
 
 // Symbol definitions
 
@@ -27,14 +28,9 @@ struct symbol_s
 	uint_t  len;    // definition length
 	uint    pass;   // walk flag
 	uint    cost;   // use cost
-	uint    pcost;  // position cost (for RSE)
 	int     gain;   // gain when defined
 
-	uchar save_keep;
-	uint  save_count;
-
-	uchar best_keep;  // save best selection
-	uint  best_len;
+	uint_t  id;    // creation order
 
 	uchar_t code;  // byte code of base symbol
 	uint_t  base;  // offset of first occurrence in input frame
@@ -44,6 +40,8 @@ struct symbol_s
 
 	struct symbol_s * left;   // left or repeated child
 	struct symbol_s * right;  // right child
+
+	struct symbol_s * hash_next;  // next derived symbol in the same index slot
 	};
 
 typedef struct symbol_s symbol_t;
@@ -51,10 +49,108 @@ typedef struct symbol_s symbol_t;
 extern list_t sym_root;
 extern uint_t sym_count;
 
-extern uint keep_count;
 extern uchar ref_bit;
 
 
+// Worker threads
+
+#define THREAD_MAX 16
+#define SCAN_RANGE_MIN 4096  // minimum pairs per thread
+
+extern uint_t thread_count;
+
+
+// Words seeded before the pair crunch
+
+extern uint_t seed_len;
+extern uint_t seed_count;
+extern uint_t seed_size;
+
+
+// Pairs crunched per round
+
+#define CRUNCH_BATCH_MAX 256
+
+extern uint_t crunch_batch;
+extern uint_t crunch_min;
+extern uint_t crunch_budget;
+
+extern uint_t crunch_round;
+extern uint_t crunch_count;
+extern uint_t crunch_left;
+
+
+// Tie-break policies between pairs of equal count
+// Policies above are seeded random orders
+
+#define TIE_OLD  0  // oldest pair first
+#define TIE_LONG 1  // longest expansion first
+
+#define TIE_MAX 16
+
+extern uint_t crunch_tie;
+
+
+// Cost table
+// Hot fields of the cost model in dense arrays indexed by symbol identifier
+// Symbols are in creation order, so children always come before parents
+
+struct table_s
+	{
+	uint_t count;      // number of symbols
+	uchar  ref_bit;    // reference bits
+	uint   keep_count; // number of kept symbols
+
+	// Tree fields
+
+	symbol_t ** sym;
+	uint_t * left;       // left or repeated child
+	uint_t * right;      // right child
+	uint_t * size;
+	uchar  * repeat;
+	uint_t * pos_count;
+	uint_t * rep_pos;
+	uint_t * rep_count;
+
+	// Selection fields
+
+	uint_t * sym_count;  // changed by dropping
+	uint_t * use_count;
+	uchar  * keep;
+	uint   * len;
+	uint   * cost;
+	uint   * pcost;      // position cost (for RSE)
+	int    * gain;
+
+	// Best selection
+
+	uchar  * best_keep;
+	uint   * best_len;
+
+	// Tree parents as edges (2 * parent + side)
+
+	uint_t * par_head;   // first parent edge of the symbol
+	uint_t * par_next;   // next parent edge of the same child
+
+	// Selection heap of the kept symbols by increasing gain
+
+	uint_t   heap_count;
+	uchar    heap_late;  // ties broken by the latest symbol first
+	uint_t * heap;
+	uint_t * heap_slot;  // index in the heap
+
+	// Symbols to update in creation order
+
+	uint_t   queue_count;
+	uint_t * queue;
+	uchar  * queued;
+	};
+
+typedef struct table_s table_t;
+
+extern table_t sym_table;
+
+
 // Pair definitions
 
 struct pair_s
@@ -62,31 +158,33 @@ struct pair_s
 	list_t node;  // must be the first member
 
 	uint_t count;  // number of occurrences in the frame
+	uint_t  serial; // creation order
+	ulong_t order;  // tie-break key between equal counts
+
+	uint_t occ_head;  // first occurrence in frame order
+	uint_t occ_tail;  // last occurrence in frame order
 
 	struct symbol_s * left;
 	struct symbol_s * right;
+
+	struct pair_s * hash_next;  // next pair in the same index slot
 	};
 
 typedef struct pair_s pair_t;
 
 
 // Position definitions
+// Sequence in flat arrays indexed by the offset in the input frame
+// A crunched position is a tombstone without symbol
 
-struct position_s
-	{
-	list_t node;  // must be the first member
-	list_t node_hole;  // list of positions without pair
-
-	uint_t base;
+#define POS_NONE ((uint_t) -1)
 
-	symbol_t * sym;
-	pair_t * pair;
-	};
-
-typedef struct position_s position_t;
+extern symbol_t * pos_sym [FRAME_MAX];  // symbol at position
+extern uint_t pos_next [FRAME_MAX];  // next position in sequence
+extern uint_t pos_prev [FRAME_MAX];  // previous position in sequence
 
-extern list_t pos_root;
-extern uint_t pos_count;  // list of positions
+extern uint_t pos_head;   // first position in sequence
+extern uint_t pos_count;  // number of positions in sequence
 
 
 // Kind of sorting
@@ -98,6 +196,10 @@ extern uint_t pos_count;  // list of positions
 #define SORT_BASE 4  // by frame order
 #define SORT_SIZE 5  // by size
 
+#define SORT_TOP_MAX 64  // partial sort below this count
+
+#define SORT_RANK(key) (~((uint_t) (key) ^ 0x80000000))  // decreasing key
+
 
 struct index_sym_s
 	{
@@ -119,21 +221,35 @@ extern uint_t index_count;
 
 // Global functions
 
+void sym_reset ();
 symbol_t * sym_add ();
+symbol_t * sym_derive (symbol_t * left, symbol_t * right, uint_t base);
+symbol_t * sym_repeat (symbol_t * child, uint_t count);
 
 void sym_sort (uint_t kind);
+void sym_top (uint_t kind, uint_t top);
 void sym_list (uint_t filter);
 
 void scan_base ();
+uchar scan_random ();
+void word_add (symbol_t * sym, uint_t pos);
+void word_holes ();
 
 void crunch_word ();
 void crunch_rep ();
 
-uint_t keep_dup ();
-void sym_drop (symbol_t * sym, uint count);
+void table_build (table_t * tab);
+void table_store (table_t * tab);
+void table_fork (table_t * tab, table_t * from);
+void table_free (table_t * tab);
+
+uint_t keep_dup (table_t * tab);
+void keep_trunc (table_t * tab, uint keep_max);
+void sym_drop (table_t * tab, uint_t i, uint count);
+uint keep_select_si (table_t * tab, uint keep_max);
 
-uint sym_cost_se (symbol_t * sym, uchar select);
-uint sym_cost_si (symbol_t * sym);
-uint sym_cost_rse (symbol_t * sym, uchar select);
+uint sym_cost_se (table_t * tab, uint_t i, uchar select);
+uint sym_cost_si (table_t * tab, uint_t i);
+uint sym_cost_rse (table_t * tab, uint_t i, uchar select);
 
 //------------------------------------------------------------------------------